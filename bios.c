@@ -28,6 +28,11 @@
 	- Core threads mask all signals except for USR1.
 	- The PIC thread receives all signals and dispatches them to
 	the right core thread by raising SIGUSR1.
+	- Interrupts are disabled by a thread-local flag of the core thread,
+	not by masking SIGUSR1. A signal arriving while the flag is set
+	leaves its interrupts pending; they are dispatched when interrupts
+	are re-enabled. Thus, disabling and enabling interrupts costs no
+	system call.
 
  */
 
@@ -123,7 +128,8 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* The handler may switch context, so it must not leave SIGUSR1 blocked */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -156,6 +162,12 @@ static inline Core* curr_core() {
 	return CORE+cpu_core_id;
 }
 
+/*
+	The interrupt flag of the core thread. When set, interrupts
+	are disabled (they are left pending by the signal handler).
+ */
+static _Thread_local volatile sig_atomic_t intr_disabled;
+
 
 /*
 	Cause PIC daemon to loop. This needs to happen when we wish 
@@ -180,6 +192,7 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	intr_disabled = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -353,7 +366,12 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+	/* The interrupts stay pending, until cpu_enable_interrupts() */
+	if(intr_disabled) return;
+
+	intr_disabled = 1;
 	dispatch_interrupts(core);
+	cpu_enable_interrupts();
 }
 
 
@@ -999,6 +1017,7 @@ void cpu_core_halt()
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 
 	Core* core = curr_core();
+	int enabled = cpu_disable_interrupts();
 	uint32_t cmask = 1 << cpu_core_id;
 
 #if defined(CORE_STATISTICS)
@@ -1014,17 +1033,14 @@ void cpu_core_halt()
 
 	siginfo_t info;
 
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
-
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+	/* Do not sleep if some interrupt was left pending, while interrupts were disabled */
+	if(! __atomic_load_n(& core->intr_pending, __ATOMIC_ACQUIRE)) {
+		/* Sleep for 10 msec */
+		//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+		//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+		int rc = sigwaitinfo(&sigusr1_set, &info);
+		assert(rc>0 || (rc==-1 &&  (errno == EINTR || errno == EAGAIN)));
+		(void) rc;
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1034,7 +1050,12 @@ void cpu_core_halt()
 
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
+	/* 
+		Unblock the signal before dispatching, since the interrupt handlers
+		may switch to another thread. Interrupts are dispatched when enabled.
+	 */
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 static int __core_restart(uint c)
@@ -1092,32 +1113,46 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return ! intr_disabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	int enabled = ! intr_disabled;
+	intr_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	return enabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	while(1) {
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		intr_disabled = 0;
+
+		/* 
+			An interrupt raised from now on will be dispatched by the signal handler.
+			Dispatch those left pending while interrupts were disabled.
+		 */
+		Core* core = curr_core();
+		if(! __atomic_load_n(& core->intr_pending, __ATOMIC_ACQUIRE)) 
+			return;
+
+		intr_disabled = 1;
+		dispatch_interrupts(core);
+	}
 }
 
 
+#if BIOS_UCONTEXT
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1140,6 +1175,88 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#else
+
+/*
+	The x86-64 context switch.
+
+	A saved context is just a stack pointer. The stack holds, from the top:
+	the return address, the callee-saved registers rbp, rbx, r12-r15, and
+	a word with the x87 control word and the MXCSR (whose control bits are
+	also callee-saved).
+
+	Nothing else needs saving, since cpu_swap_context() is called as a 
+	function: the caller-saved registers are dead across the call.
+	The signal mask is left alone (see bios.h).
+ */
+void cpu_context_start();
+
+__asm__(
+	"	.text\n"
+	"	.globl cpu_swap_context\n"
+	"	.type cpu_swap_context, @function\n"
+	"cpu_swap_context:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size cpu_swap_context, .-cpu_swap_context\n"
+	"\n"
+	/* The first switch to a new context returns here, with the function in r12 */
+	"	.globl cpu_context_start\n"
+	"	.hidden cpu_context_start\n"
+	"	.type cpu_context_start, @function\n"
+	"cpu_context_start:\n"
+	"	callq *%r12\n"
+	"	callq abort@PLT\n"
+	"	.size cpu_context_start, .-cpu_context_start\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The stack must be 16-byte aligned at the call in cpu_context_start() */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* frame = (uint64_t*)(top - 80);
+
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	__asm__ volatile ("stmxcsr %0" : "=m" (mxcsr));
+	__asm__ volatile ("fnstcw %0" : "=m" (fpucw));
+
+	frame[0] = mxcsr | ((uint64_t)fpucw << 32);
+	frame[1] = 0;						/* r15 */
+	frame[2] = 0;						/* r14 */
+	frame[3] = 0;						/* r13 */
+	frame[4] = (uintptr_t) ctx_func;	/* r12 */
+	frame[5] = 0;						/* rbx */
+	frame[6] = 0;						/* rbp, the end of the frame chain */
+	frame[7] = (uintptr_t) cpu_context_start;	/* return address */
+	frame[8] = 0;
+	frame[9] = 0;
+
+	ctx->sp = frame;
+}
+
+#endif
+
 
 
 /*
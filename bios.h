@@ -405,10 +405,33 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Use the ucontext-based context switch.
+
+	On x86-64, the BIOS switches contexts with a few lines of assembly,
+	which only save the callee-saved registers and the stack pointer of 
+	the old context. Elsewhere (or when this is defined non-zero), 
+	it falls back to @c swapcontext(), which also performs a system call to
+	save and restore the signal mask.
+*/
+#ifndef BIOS_UCONTEXT
+#if defined(__x86_64__)
+#define BIOS_UCONTEXT 0
+#else
+#define BIOS_UCONTEXT 1
+#endif
+#endif
+
 /**
 	@brief A type for saving CPU context into.
 */
+#if BIOS_UCONTEXT
 typedef ucontext_t cpu_context_t;
+#else
+typedef struct cpu_context {
+	void* sp;	/**< @brief The saved stack pointer. The registers are saved on the stack. */
+} cpu_context_t;
+#endif
 
 
 /**
@@ -430,6 +453,11 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 	Save the current context into @c oldctx and load the contents of @c newctx
 	into the CPU.
 
+	The signal mask (i.e., the interrupt state) is not part of the context; 
+	the new context runs with the interrupt state of the caller. 
+	Therefore, this should be called with interrupts disabled, and it is up to the
+	new context to re-enable them.
+
 	@param oldctx pointer to the storage for the old context
 	@param newctx pointer to the new context to be loaded
 */
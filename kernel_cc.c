@@ -19,50 +19,488 @@
   */
 
 
+/*
+	Lock statistics are recorded in per-core tables, indexed by the 
+	address and kind of the lock. They are dumped at the end of this file.
+ */
+#if LOCK_STATS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOCK_STATS_SLOTS 1024
+
+static lock_stats_t lock_stats_table[MAX_CORES][LOCK_STATS_SLOTS];
+static unsigned long lock_stats_lost[MAX_CORES];
+
+static unsigned long lock_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ul + ts.tv_nsec;
+}
+
+static void lock_stats_add(const void* lock, const char* kind, void* site, 
+	int contended, unsigned long spins, unsigned long sleeps, unsigned long wait_ns)
+{
+	int preempt = preempt_off;
+	lock_stats_t* table = lock_stats_table[cpu_core_id];
+	uintptr_t h = ((uintptr_t)lock >> 3) % LOCK_STATS_SLOTS;
+
+	for(uint i=0; i<LOCK_STATS_SLOTS; i++) {
+		lock_stats_t* ls = & table[(h+i) % LOCK_STATS_SLOTS];
+		if(ls->lock == NULL) {
+			ls->lock = lock;
+			ls->kind = kind;
+			ls->site = site;
+		}
+		if(ls->lock == lock && ls->kind == kind) {
+			ls->acquisitions++;
+			ls->contended += contended;
+			ls->spins += spins;
+			ls->sleeps += sleeps;
+			ls->wait_ns += wait_ns;
+			goto done;
+		}
+	}
+	lock_stats_lost[cpu_core_id]++;
+done:
+	if(preempt) preempt_on;
+}
+
+#define LOCK_STATS_START(t0)  unsigned long t0 = lock_clock()
+#define LOCK_STATS_RECORD(lock, kind, site, contended, spins, sleeps, t0) \
+	lock_stats_add((lock), (kind), (site), (contended), (spins), (sleeps), (t0) ? lock_clock()-(t0) : 0)
+
+#else
+
+#define LOCK_STATS_START(t0)
+#define LOCK_STATS_RECORD(lock, kind, site, contended, spins, sleeps, t0) ((void)(spins), (void)(sleeps))
+
+#endif
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
 
- 	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	This mutex will act as a queued spinlock if interrupts are off, and a
+ 	sleeping mutex if they are on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	Spinners queue up MCS-style on @c spinq, each spinning on a flag in its
+ 	own stack frame, so that only the head of the queue polls the lock byte.
+ 	Sleepers are kept in a FIFO ring at @c waitq, which is protected by one of
+ 	a few hashed guard mutexes. The guards are only ever locked with
+ 	preemption off, so they never sleep themselves.
+
+ 	A sleeper marks the lock byte as contended before it parks. Unlocking an
+ 	uncontended mutex is a single release of the lock byte, after which the
+ 	mutex is not touched again, since its new owner may free it at once.
+ 	When a contended mutex is unlocked, the lock byte stays set and
+ 	ownership passes directly to the first sleeper, under the guard, which
+ 	therefore does not need to compete for the lock after waking up.
+
+ 	A thread going to sleep lends its scheduling priority to the owner, so
+ 	that an owner demoted by the MLFQ scheduler is not starved by the threads
+ 	waiting for it. When the owner hands the lock over, the waiters left in
+ 	the queue lend their priority to the new owner instead.
+
+ 	The owner thread is recorded in the mutex. In the preemptive domain, a
+ 	waiter spins only as long as the owner is the current thread of some
+ 	core; once the owner is preempted (or sleeps), spinning is pointless and
+ 	the waiter goes to sleep at once.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
+
+/** \cond HELPER Helper structures for mutexes. */
+typedef struct __mcs_node {
+	struct __mcs_node* volatile next;	/* the next spinner in the queue */
+	volatile int wait;					/* cleared when we become the head */
+} __mcs_node;
+
+typedef struct __mutex_waiter {
+	rlnode node;				/* become part of the waitq ring */
+	TCB* thread;				/* the sleeping thread */
+	volatile int granted;		/* set when the mutex is handed to us */
+	Mutex* mx;					/* the mutex we wait at, or NULL */
+	ksem_t* sem;				/* the semaphore we wait at, or NULL */
+	int lent;					/* the priority lent to the owner, or -1 */
+} __mutex_waiter;
+/** \endcond */
+
+/* Values of the lock byte */
+#define MUTEX_FREE 0
+#define MUTEX_HELD 1
+#define MUTEX_CONTENDED 2	/* held, and there may be sleepers */
+
+#define MUTEX_GUARDS 64
+static Mutex mutex_guard[MUTEX_GUARDS];
+
+static void mutex_lock(Mutex* mx, const char* kind, void* site);
+
+static inline Mutex* guard_of(Mutex* mx)
 {
-#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+	return & mutex_guard[((uintptr_t)mx >> 4) % MUTEX_GUARDS];
+}
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+static inline void cpu_relax()
+{
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+	__builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
-      }
-    }
-  }
+}
+
+static inline int mutex_trylock(Mutex* mx)
+{
+	char free = MUTEX_FREE;
+	return __atomic_load_n(&mx->locked, __ATOMIC_RELAXED)==MUTEX_FREE
+		&& __atomic_compare_exchange_n(&mx->locked, &free, MUTEX_HELD, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void set_owner(Mutex* mx, TCB* owner)
+{
+	__atomic_store_n((TCB**) &mx->owner, owner, __ATOMIC_RELAXED);
+}
+
+/* Is the thread running on some core? The TCB is only compared, never
+   dereferenced, since it may have been released meanwhile. */
+static int owner_running(TCB* owner)
+{
+	for(uint c=0; c<cpu_cores(); c++)
+		if(__atomic_load_n(&cctx[c].current_thread, __ATOMIC_RELAXED) == owner)
+			return 1;
+	return 0;
+}
+
+
+/*
+	Priority inheritance.
+
+	A waiter lends its priority to the owner of the lock while holding the 
+	guard of the lock (the monitor mutex, for a semaphore). The owner needs
+	the guard to hand the lock over, so it cannot go away meanwhile. If the
+	owner is itself parked at another lock, the priority is passed on along
+	the chain of owners, as far as the guards on the way can be taken 
+	without waiting.
+
+	A thread that exits holding a mutex is never released (see release_TCB),
+	so the owner of a lock can always be looked at; nothing is lent to it 
+	once it has exited.
+*/
+#define PI_CHAIN_MAX 8
+
+static inline Mutex* waiter_guard(__mutex_waiter* w)
+{
+	return w->sem ? & w->sem->mx : guard_of(w->mx);
+}
+
+static inline TCB* waiter_owner(__mutex_waiter* w)
+{
+	return w->sem ? w->sem->owner : __atomic_load_n((TCB**) &w->mx->owner, __ATOMIC_RELAXED);
+}
+
+/* Called when w is queued, under the guard of its lock */
+static inline void waiter_park(__mutex_waiter* w, Mutex* mx, ksem_t* sem)
+{
+	w->mx = mx;
+	w->sem = sem;
+	w->lent = -1;
+	__atomic_store_n((__mutex_waiter**) &w->thread->lock_waiter, w, __ATOMIC_RELEASE);
+}
+
+/* Lend the priority of w's thread to owner. The guard of w's lock is held. */
+static void pi_lend(__mutex_waiter* w, TCB* owner)
+{
+	Mutex* held = NULL;
+	int prio = sched_priority(w->thread);
+
+	for(int depth=0; depth < PI_CHAIN_MAX && owner && owner->state != EXITED
+			&& prio > w->lent; depth++) {
+		int lent = prio;
+		prio = sched_lend_priority(owner, w->lent, lent);
+		w->lent = lent;
+
+		/* Follow the owner to the lock it is parked at, if any */
+		__mutex_waiter* next = __atomic_load_n((__mutex_waiter**) &owner->lock_waiter, __ATOMIC_ACQUIRE);
+		if(next == NULL) break;
+		Mutex* guard = waiter_guard(next);
+		if(! mutex_trylock(guard)) break;
+		set_owner(guard, cur_thread());
+		cur_thread()->held_mutexes++;
+		if(__atomic_load_n((__mutex_waiter**) &owner->lock_waiter, __ATOMIC_RELAXED) != next
+				|| waiter_guard(next) != guard) {
+			/* It got that lock meanwhile */
+			Mutex_Unlock(guard);
+			break;
+		}
+
+		if(held) Mutex_Unlock(held);
+		held = guard;
+		w = next;
+		owner = waiter_owner(next);
+	}
+
+	if(held) Mutex_Unlock(held);
+}
+
+/* The lock of w is handed from owner to w. The waiters left start at q. 
+   Called under the guard of the lock. */
+static void pi_handoff(TCB* owner, __mutex_waiter* w, __mutex_waiter* q)
+{
+	__atomic_store_n((__mutex_waiter**) &w->thread->lock_waiter, NULL, __ATOMIC_RELAXED);
+	if(owner == NULL || owner->state == EXITED || owner->inherited_priority < 0) return;
+
+	if(w->lent >= 0)
+		sched_lend_priority(owner, w->lent, -1);
+
+	int lent[PQ] = { 0 };
+	int lenders = 0;
+	if(q) {
+		__mutex_waiter* r = q;
+		do {
+			if(r->lent >= 0) {
+				lent[r->lent]++;
+				lenders++;
+			}
+			r = r->node.next->obj;
+		} while(r != q);
+	}
+	if(lenders) sched_pass_priority(owner, w->thread, lent);
+}
+
+
+/* Spin until the lock is ours, in FIFO order with the other spinners.
+   Returns the number of spins. */
+static unsigned long mutex_spin(Mutex* mx)
+{
+	__mcs_node node = { .next = NULL, .wait = 1 };
+	unsigned long spins = 0;
+
+	__mcs_node* prev = __atomic_exchange_n((__mcs_node**) &mx->spinq, &node, __ATOMIC_ACQ_REL);
+	if(prev) {
+		__atomic_store_n(&prev->next, &node, __ATOMIC_RELEASE);
+		while(__atomic_load_n(&node.wait, __ATOMIC_ACQUIRE)) {
+			cpu_relax();
+			spins++;
+		}
+	}
+
+	/* We are the head of the queue; only we poll the lock byte */
+	while(! mutex_trylock(mx)) {
+		cpu_relax();
+		spins++;
+	}
+
+	/* Pass the head of the queue to the next spinner */
+	__mcs_node* self = &node;
+	if(! __atomic_compare_exchange_n((__mcs_node**) &mx->spinq, &self, NULL, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		__mcs_node* next;
+		while((next = __atomic_load_n(&node.next, __ATOMIC_ACQUIRE)) == NULL)
+			cpu_relax();
+		__atomic_store_n(&next->wait, 0, __ATOMIC_RELEASE);
+	}
+	return spins;
+}
+
+
+static inline void remove_from_waitq(Mutex* mx, __mutex_waiter* w)
+{
+	if(mx->waitq == w) {
+		__mutex_waiter* nextw = w->node.next->obj;
+		mx->waitq = (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
+}
+
+
+/* 
+	Queue a waiter at the mutex, or lock the mutex on its behalf if it is free.
+	The guard of the mutex must be held. Returns 1 if the waiter got the lock.
+*/
+static int mutex_enqueue(Mutex* mx, __mutex_waiter* w)
+{
+	/* Either we lock the free mutex, or we mark it contended, so that its
+	   owner hands it over under the guard instead of releasing it. */
+	char c = __atomic_load_n(&mx->locked, __ATOMIC_ACQUIRE);
+	for(;;) {
+		if(c == MUTEX_FREE) {
+			if(__atomic_compare_exchange_n(&mx->locked, &c, MUTEX_HELD, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				set_owner(mx, w->thread);
+				return 1;
+			}
+		}
+		else if(c == MUTEX_CONTENDED
+			|| __atomic_compare_exchange_n(&mx->locked, &c, MUTEX_CONTENDED, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	waiter_park(w, mx, NULL);
+	if(mx->waitq == NULL)
+		mx->waitq = w;
+	else
+		rlist_push_back(& ((__mutex_waiter*)mx->waitq)->node, & w->node);
+	return 0;
+}
+
+/* Sleep until the mutex is handed to a queued waiter. Preemption must be off. */
+static void mutex_await_grant(Mutex* mx, __mutex_waiter* w)
+{
+	Mutex* guard = guard_of(mx);
+	mutex_lock(guard, "mutex_guard", __builtin_return_address(0));
+	while(! w->granted) {
+		sleep_releasing(STOPPED, guard, SCHED_MUTEX, NO_TIMEOUT);
+		mutex_lock(guard, "mutex_guard", __builtin_return_address(0));
+	}
+	Mutex_Unlock(guard);
+}
+
+/* Sleep until the lock is handed to us */
+static void mutex_park(Mutex* mx)
+{
+	__mutex_waiter waiter = { .thread = cur_thread(), .granted = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	int preempt = preempt_off;
+	Mutex* guard = guard_of(mx);
+
+	mutex_lock(guard, "mutex_guard", __builtin_return_address(0));
+	int locked = mutex_enqueue(mx, &waiter);
+	/* Do not let the owner starve while we wait */
+	if(! locked)
+		pi_lend(&waiter, __atomic_load_n((TCB**) &mx->owner, __ATOMIC_RELAXED));
+	Mutex_Unlock(guard);
+	if(! locked)
+		mutex_await_grant(mx, &waiter);
+
+	if(preempt) preempt_on;
+}
+
+
+/* 
+	Spin while the owner is running elsewhere. Returns 1 if we got the lock.
+	Spinning is pointless when there are sleepers (they get the lock first)
+	and when we cannot see the owner (it has not recorded itself yet), we
+	spin only for a short while.
+*/
+static int mutex_spin_on_owner(Mutex* mx, unsigned long* spins)
+{
+#define MUTEX_SPINS 100
+	int spin = MUTEX_SPINS;
+	for(;;) {
+		if(mutex_trylock(mx)) return 1;
+		if(__atomic_load_n((void**) &mx->waitq, __ATOMIC_RELAXED) != NULL) return 0;
+		TCB* owner = __atomic_load_n((TCB**) &mx->owner, __ATOMIC_RELAXED);
+		if(owner ? !owner_running(owner) : --spin < 0) return 0;
+		cpu_relax();
+		(*spins)++;
+	}
 #undef MUTEX_SPINS
 }
 
 
-void Mutex_Unlock(Mutex* lock)
+/* The kind and call site are only used for lock statistics */
+static void mutex_lock(Mutex* mx, const char* kind, void* site)
+{
+	TCB* self = cur_thread();
+	if(self) self->held_mutexes++;
+
+	if(mutex_trylock(mx)) {
+		set_owner(mx, self);
+		LOCK_STATS_RECORD(mx, kind, site, 0, 0, 0, 0);
+		return;
+	}
+
+	LOCK_STATS_START(t0);
+	unsigned long spins = 0;
+
+	if(! cpu_interrupts_enabled()) {
+		spins = mutex_spin(mx);
+		set_owner(mx, self);
+		LOCK_STATS_RECORD(mx, kind, site, 1, spins, 0, t0);
+		return;
+	}
+
+	if(cpu_cores() > 1 && mutex_spin_on_owner(mx, &spins)) {
+		set_owner(mx, self);
+		LOCK_STATS_RECORD(mx, kind, site, 1, spins, 0, t0);
+		return;
+	}
+
+	mutex_park(mx);
+	LOCK_STATS_RECORD(mx, kind, site, 1, spins, 1, t0);
+}
+
+void Mutex_Lock(Mutex* mx)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+	mutex_lock(mx, "mutex", __builtin_return_address(0));
+}
+
+
+void Mutex_Unlock(Mutex* mx)
+{
+	TCB* owner = __atomic_load_n((TCB**) &mx->owner, __ATOMIC_RELAXED);
+	set_owner(mx, NULL);
+	if(owner) owner->held_mutexes--;
+
+	/* Without sleepers, this release is our last access to the mutex */
+	char held = MUTEX_HELD;
+	if(__atomic_compare_exchange_n(&mx->locked, &held, MUTEX_FREE, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return;
+
+	/* Contended: sleepers can only queue up under the guard, so we decide
+	   under the guard, and the next owner cannot run before we release it */
+	int preempt = preempt_off;
+	Mutex* guard = guard_of(mx);
+	mutex_lock(guard, "mutex_guard", __builtin_return_address(0));
+
+	__mutex_waiter* w = mx->waitq;
+	if(w) {
+		/* Hand the lock over; it stays locked */
+		remove_from_waitq(mx, w);
+		if(mx->waitq == NULL)
+			__atomic_store_n(&mx->locked, MUTEX_HELD, __ATOMIC_RELAXED);
+		TCB* thread = w->thread;
+		pi_handoff(owner, w, mx->waitq);
+		set_owner(mx, thread);
+		w->granted = 1;
+		wakeup(thread);
+	} else {
+		__atomic_store_n(&mx->locked, MUTEX_FREE, __ATOMIC_RELEASE);
+	}
+
+	Mutex_Unlock(guard);
+	if(preempt) preempt_on;
 }
 
 
 /*
 	Condition variables.	
+
+	Cond_Broadcast avoids the thundering herd by wait-morphing: the waiters
+	are not woken up, but moved to where they would block next anyway, to be 
+	woken up one at a time as the lock is released. If the lock is free, the
+	first of them gets it at once.
+
+	- A waiter that will relock its mutex in the preemptive domain is queued
+	  at the wait queue of the mutex, and will get the mutex by handoff.
+	- A waiter of a kernel semaphore is queued at the semaphore, and will
+	  get the semaphore by handoff. Since @c sem->mx is locked before a
+	  waitset lock in @c cv_wait, these waiters are collected first and
+	  queued after the waitset lock is released.
+
+	Waiters that relock a spinning mutex are always woken up.
 */
 
 
@@ -70,12 +508,22 @@ void Mutex_Unlock(Mutex* lock)
 typedef struct __cv_waiter {
 	rlnode node;				/* become part of a ring */
 	TCB* thread;				/* thread to wait */
+	Mutex* mutex;				/* if non-NULL, requeue here on broadcast */
+	ksem_t* sem;				/* if non-NULL, requeue here on broadcast */
+	__mutex_waiter mw;			/* our place in the wait queue of @c mutex 
+								   or @c sem */
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	sig_atomic_t requeued;		/* this is set if we were queued at @c mutex
+								   or @c sem */
 } __cv_waiter;
 /** \endcond */
 
+static int ksem_enqueue(ksem_t* sem, __mutex_waiter* w);
+static int ksem_await_grant(ksem_t* sem, __mutex_waiter* w);
+static int ksem_acquire(ksem_t* sem);
+
 /**
    @internal
    A helper routine to remove a condition waiter from the CondVar ring.
@@ -110,6 +558,10 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 
   @param mx The mutex to be unlocked as the thread sleeps.
   @param cv The condition variable to sleep on.
+  @param sem If not NULL, a locked kernel semaphore whose monitor mutex is 
+     @c mutex. The semaphore is reacquired (and @c mutex is left unlocked) 
+     before returning, and a broadcast may queue this thread at the semaphore
+     instead of waking it.
   @param cause A cause provided to the kernel scheduler.
   @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
 
@@ -118,13 +570,24 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Signal
   @see Cond_Broadcast
   */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
+static int cv_wait(Mutex* mutex, CondVar* cv, ksem_t* sem,
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .sem = sem,
+		.signalled = 0, .removed=0, .requeued = 0 };
 	rlnode_init(& waiter.node, &waiter);
+	waiter.mw = (__mutex_waiter){ .thread = waiter.thread, .granted = 0 };
+	rlnode_init(& waiter.mw.node, & waiter.mw);
+
+	LOCK_STATS_START(t0);
+
+	/* Do not get preempted while holding the waitset lock */
+	int preempt = preempt_off;
 
-	Mutex_Lock(&(cv->waitset_lock));
+	/* Only a mutex relocked in the preemptive domain can be handed to us */
+	waiter.mutex = preempt ? mutex : NULL;
+
+	mutex_lock(&(cv->waitset_lock), "waitset_lock", __builtin_return_address(0));
 	/* We just push the current thread to the back of the list */
 	if(cv->waitset) {
 		__cv_waiter* wset = cv->waitset;
@@ -137,8 +600,8 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	Mutex_Unlock(mutex);
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
-	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
+	/* Woke up, we must check wether we were signaled, and tidy up. */
+	mutex_lock(&(cv->waitset_lock), "waitset_lock", __builtin_return_address(0));
 	if(! waiter.removed) {
 		assert(! waiter.signalled);
 
@@ -147,7 +610,24 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
-	Mutex_Lock(mutex);
+	/* If we were queued at the mutex or semaphore, it will be handed to us */
+	if(waiter.requeued) {
+		if(sem) {
+			mutex_lock(& sem->mx, "ksem.mx", __builtin_return_address(0));
+			ksem_await_grant(sem, &waiter.mw);
+		}
+		else
+			mutex_await_grant(mutex, &waiter.mw);
+	}
+
+	if(preempt) preempt_on;
+
+	if(! waiter.requeued) {
+		Mutex_Lock(mutex);
+		if(sem) ksem_acquire(sem);
+	}
+
+	LOCK_STATS_RECORD(cv, "cv", __builtin_return_address(0), 1, 0, 1, t0);
 	return waiter.signalled;
 }
 
@@ -173,32 +653,99 @@ static inline void cv_signal(CondVar* cv)
 }
 
 
+/**
+  @internal
+  Helper for Cond_Broadcast. Move a waiter from @c cv to the mutex where
+  it would block next, if possible, without waking it up.
+ */
+static inline void cv_requeue(CondVar* cv, __cv_waiter* w)
+{
+	if(w->mutex) {
+		remove_from_ring(cv, w);
+		w->removed = 1;
+		w->signalled = 1;
+		w->requeued = 1;
+
+		Mutex* guard = guard_of(w->mutex);
+		mutex_lock(guard, "mutex_guard", __builtin_return_address(0));
+		if(mutex_enqueue(w->mutex, & w->mw)) {
+			/* The mutex was free, and it is now ours */
+			w->mw.granted = 1;
+			wakeup(w->thread);
+		}
+		Mutex_Unlock(guard);
+	}
+}
+
 
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
-	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
+	return cv_wait(mutex, cv, NULL, SCHED_USER, NO_TIMEOUT);
 }
 
 int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 {
 	/* We have to translate timeout from msec to usec */
-	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul);
+	return cv_wait(mutex, cv, NULL, SCHED_USER, timeout*1000ul);
 }
 
 
+/* 
+  The waitset lock is held with preemption off, since the woken threads
+  may preempt us, and spin on it.
+ */
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
+  int preempt = preempt_off;
+  mutex_lock(&(cv->waitset_lock), "waitset_lock", __builtin_return_address(0));
   cv_signal(cv);
   Mutex_Unlock(&(cv->waitset_lock));
+  if(preempt) preempt_on;
 }
 
 
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
+  int preempt = preempt_off;
+  mutex_lock(&(cv->waitset_lock), "waitset_lock", __builtin_return_address(0));
+
+  /* Requeue every waiter that can be requeued, then wake up whoever is left */
+  rlnode to_sem;
+  rlnode_init(& to_sem, NULL);
+  __cv_waiter* w = cv->waitset;
+  if(w) {
+    __cv_waiter* last = w->node.prev->obj;
+    for(;;) {
+      __cv_waiter* next = w->node.next->obj;
+      int done = (w == last);
+      if(w->sem) {
+        remove_from_ring(cv, w);
+        w->removed = 1;
+        w->signalled = 1;
+        w->requeued = 1;
+        rlist_push_back(& to_sem, & w->node);
+      } else
+        cv_requeue(cv, w);
+      if(done) break;
+      w = next;
+    }
+  }
   while(cv->waitset) cv_signal(cv);
+
   Mutex_Unlock(&(cv->waitset_lock));
+
+  /* Queue the semaphore waiters, waking only those that get it at once */
+  while(! is_rlist_empty(& to_sem)) {
+    __cv_waiter* w = rlist_pop_front(& to_sem)->obj;
+    ksem_t* sem = w->sem;
+    TCB* thread = w->thread;
+    mutex_lock(& sem->mx, "ksem.mx", __builtin_return_address(0));
+    if(ksem_enqueue(sem, & w->mw))
+      wakeup(thread);
+    Mutex_Unlock(& sem->mx);
+  }
+
+  if(preempt) preempt_on;
 }
 
 
@@ -207,85 +754,364 @@ void Cond_Broadcast(CondVar* cv)
 
 /*
  *
- * The kernel locks
+ * The kernel semaphores
  *
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
+/*
+ * Kernel locking is provided by semaphores, implemented as monitors.
+ * A semaphore for kernel locking has advantages over a simple mutex. 
+ * The main advantage is that @c sem->mx is held for a very short time
  * regardless of contention. Thus, in multicore machines, it allows for cores
  * to be passed to other threads. 
- * 
+ *
+ * Contending threads queue at @c sem->waitq, and a release hands the
+ * semaphore to the oldest of them (the counter stays at 0). A woken waiter
+ * already owns the semaphore, so it does not contend again, and it is not
+ * overtaken by threads arriving later.
+ *
+ * A thread that queues lends its priority to the owner of the semaphore, 
+ * as for mutexes.
+ *
+ * Preemption is off while @c sem->mx is held, else a thread woken up
+ * could preempt us and spin on the mutex.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
+/* Take the semaphore if it is free, else queue the waiter. 
+   Called with sem->mx held. Returns 1 if the semaphore was taken. */
+static int ksem_enqueue(ksem_t* sem, __mutex_waiter* w)
+{
+	if(sem->count > 0) {
+		sem->count--;
+		sem->owner = w->thread;
+		w->granted = 1;
+		return 1;
+	}
+	waiter_park(w, NULL, sem);
+	if(sem->waitq == NULL)
+		sem->waitq = w;
+	else
+		rlist_push_back(& ((__mutex_waiter*)sem->waitq)->node, & w->node);
+	return 0;
+}
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+/* Sleep until the semaphore is handed to a queued waiter. Called with 
+   sem->mx held; it returns with sem->mx released. Returns the sleeps. */
+static int ksem_await_grant(ksem_t* sem, __mutex_waiter* w)
+{
+	int sleeps = 0;
+	while(! w->granted) {
+		sleep_releasing(STOPPED, & sem->mx, SCHED_MUTEX, NO_TIMEOUT);
+		sleeps++;
+		if(w->granted) return sleeps;
+
+		/* Woken up by someone else; check again under the lock */
+		mutex_lock(& sem->mx, "ksem.mx", __builtin_return_address(0));
+	}
+	Mutex_Unlock(& sem->mx);
+	return sleeps;
+}
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+/* Take the semaphore, or queue and sleep until it is handed to us. 
+   Called with sem->mx held; it returns with sem->mx released. */
+static int ksem_acquire(ksem_t* sem)
+{
+	__mutex_waiter waiter = { .thread = cur_thread(), .granted = 0 };
+	rlnode_init(& waiter.node, &waiter);
+	if(! ksem_enqueue(sem, &waiter))
+		pi_lend(&waiter, sem->owner);
+	return ksem_await_grant(sem, &waiter);
+}
 
-void kernel_lock()
+/* Hand the semaphore to the oldest waiter, or increase the counter. 
+   Called with sem->mx held. */
+static void ksem_release(ksem_t* sem)
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	if(sem->waitq) {
+		__mutex_waiter* w = sem->waitq;
+		__mutex_waiter* nextw = w->node.next->obj;
+		sem->waitq = (nextw == w) ? NULL : nextw;
+		rlist_remove(& w->node);
+
+		TCB* thread = w->thread;
+		pi_handoff(sem->owner, w, sem->waitq);
+		sem->owner = thread;
+		w->granted = 1;
+		wakeup(thread);
+	} else {
+		sem->owner = NULL;
+		sem->count++;
 	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
 }
 
-void kernel_unlock()
+void ksem_lock(ksem_t* sem)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+	LOCK_STATS_START(t0);
+
+	int preempt = preempt_off;
+	mutex_lock(& sem->mx, "ksem.mx", __builtin_return_address(0));
+	int sleeps = ksem_acquire(sem);
+	if(preempt) preempt_on;
+
+	LOCK_STATS_RECORD(sem, "ksem", __builtin_return_address(0), sleeps>0, 0, sleeps, sleeps ? t0 : 0);
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
-	const char* wchan_name, TimerDuration timeout)
+void ksem_unlock(ksem_t* sem)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+	int preempt = preempt_off;
+	mutex_lock(& sem->mx, "ksem.mx", __builtin_return_address(0));
+	ksem_release(sem);
+	Mutex_Unlock(& sem->mx);
+	if(preempt) preempt_on;
+}
 
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+int ksem_wait_wchan(ksem_t* sem, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	/* Atomically release the semaphore */
+	int preempt = preempt_off;
+	mutex_lock(& sem->mx, "ksem.mx", __builtin_return_address(0));
+	ksem_release(sem);
 
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
+	/* This reacquires the semaphore */
+	int ret = cv_wait(& sem->mx, cv, sem, cause, timeout);
+	if(preempt) preempt_on;
 
 	return ret;
 }
 
-void kernel_signal(CondVar* cv) 
-{ 
-	Cond_Signal(cv); 
+void ksem_sleep(ksem_t* sem, Thread_state newstate, enum SCHED_CAUSE cause)
+{
+	int preempt = preempt_off;
+	mutex_lock(& sem->mx, "ksem.mx", __builtin_return_address(0));
+	ksem_release(sem);
+	sleep_releasing(newstate, & sem->mx, cause, NO_TIMEOUT);
+	if(preempt) preempt_on;
 }
 
-void kernel_broadcast(CondVar* cv) 
-{ 
-	Cond_Broadcast(cv); 
+
+
+/*
+ *
+ * Reader-writer locks
+ *
+ * These are monitors, like the kernel semaphores.
+ */
+
+void krw_read_lock(krwlock_t* rw)
+{
+	int preempt = preempt_off;
+	mutex_lock(& rw->mx, "krwlock.mx", __builtin_return_address(0));
+	while(rw->readers < 0 || rw->writers_waiting > 0)
+		Cond_Wait(& rw->mx, & rw->readers_cv);
+	rw->readers++;
+	Mutex_Unlock(& rw->mx);
+	if(preempt) preempt_on;
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void krw_read_unlock(krwlock_t* rw)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	int preempt = preempt_off;
+	mutex_lock(& rw->mx, "krwlock.mx", __builtin_return_address(0));
+	assert(rw->readers > 0);
+	if(--rw->readers == 0)
+		Cond_Signal(& rw->writers_cv);
+	Mutex_Unlock(& rw->mx);
+	if(preempt) preempt_on;
 }
 
+void krw_write_lock(krwlock_t* rw)
+{
+	int preempt = preempt_off;
+	mutex_lock(& rw->mx, "krwlock.mx", __builtin_return_address(0));
+	rw->writers_waiting++;
+	while(rw->readers != 0)
+		Cond_Wait(& rw->mx, & rw->writers_cv);
+	rw->writers_waiting--;
+	rw->readers = -1;
+	Mutex_Unlock(& rw->mx);
+	if(preempt) preempt_on;
+}
+
+void krw_write_unlock(krwlock_t* rw)
+{
+	int preempt = preempt_off;
+	mutex_lock(& rw->mx, "krwlock.mx", __builtin_return_address(0));
+	assert(rw->readers == -1);
+	rw->readers = 0;
+	if(rw->writers_waiting > 0)
+		Cond_Signal(& rw->writers_cv);
+	else
+		Cond_Broadcast(& rw->readers_cv);
+	Mutex_Unlock(& rw->mx);
+	if(preempt) preempt_on;
+}
+
+
+
+/*
+ *
+ * Read-copy-update
+ *
+ * Readers run with preemption off, so a read section never spans a
+ * context switch, and it stays on one core. Each core counts the entries
+ * and exits of its outermost read sections in @c rcu_seq, which is odd
+ * while a section is in progress. A grace period ends when every core that
+ * was in a section at its start has moved past that section.
+ */
+
+void rcu_read_lock()
+{
+	int preempt = preempt_off;
+	CCB* ccb = & cctx[cpu_core_id];
+	if(ccb->rcu_nesting++ == 0) {
+		ccb->rcu_preempt = preempt;
+		__atomic_store_n(& ccb->rcu_seq, ccb->rcu_seq+1, __ATOMIC_RELAXED);
+		/* Our reads must not move before the update of rcu_seq */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void rcu_read_unlock()
+{
+	CCB* ccb = & cctx[cpu_core_id];
+	assert(ccb->rcu_nesting > 0);
+	if(--ccb->rcu_nesting == 0) {
+		__atomic_store_n(& ccb->rcu_seq, ccb->rcu_seq+1, __ATOMIC_RELEASE);
+		if(ccb->rcu_preempt) preempt_on;
+	}
+}
+
+void rcu_gp_start(rcu_gp* gp)
+{
+	/* Order the unpublishing of data before the scan */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for(uint c=0; c<cpu_cores(); c++)
+		gp->seq[c] = __atomic_load_n(& cctx[c].rcu_seq, __ATOMIC_ACQUIRE);
+}
+
+int rcu_gp_done(rcu_gp* gp)
+{
+	for(uint c=0; c<cpu_cores(); c++)
+		if((gp->seq[c] & 1) && 
+			__atomic_load_n(& cctx[c].rcu_seq, __ATOMIC_ACQUIRE) == gp->seq[c])
+			return 0;
+	return 1;
+}
+
+void rcu_synchronize()
+{
+	rcu_gp gp;
+	rcu_gp_start(&gp);
+	while(! rcu_gp_done(&gp))
+		cpu_relax();
+}
 
 
 
+#if LOCK_STATS
+
+/*
+ *
+ * Lock statistics report
+ *
+ */
+
+#define LOCK_NAMES 64
+static struct { const void* lock; const char* name; } lock_names[LOCK_NAMES];
+static unsigned int lock_names_count;
+
+void lock_stats_name(const void* lock, const char* name)
+{
+	unsigned int i = __atomic_fetch_add(&lock_names_count, 1, __ATOMIC_RELAXED);
+	if(i < LOCK_NAMES) {
+		lock_names[i].lock = lock;
+		lock_names[i].name = name;
+	}
+}
+
+static const char* lock_name(const void* lock)
+{
+	for(unsigned int i=0; i<lock_names_count && i<LOCK_NAMES; i++)
+		if(lock_names[i].lock == lock) return lock_names[i].name;
+	return NULL;
+}
+
+int lock_stats_get(const void* lock, const char* kind, lock_stats_t* stats)
+{
+	memset(stats, 0, sizeof(lock_stats_t));
+	for(uint c=0; c<cpu_cores(); c++)
+		for(uint i=0; i<LOCK_STATS_SLOTS; i++) {
+			lock_stats_t* ls = & lock_stats_table[c][i];
+			if(ls->lock != lock || strcmp(ls->kind, kind)!=0) continue;
+			if(stats->lock == NULL) *stats = *ls;
+			else {
+				stats->acquisitions += ls->acquisitions;
+				stats->contended += ls->contended;
+				stats->spins += ls->spins;
+				stats->sleeps += ls->sleeps;
+				stats->wait_ns += ls->wait_ns;
+			}
+		}
+	return stats->lock != NULL;
+}
+
+static int by_wait_time(const void* a, const void* b)
+{
+	const lock_stats_t *x = a, *y = b;
+	if(x->wait_ns != y->wait_ns) return (x->wait_ns < y->wait_ns) ? 1 : -1;
+	if(x->contended != y->contended) return (x->contended < y->contended) ? 1 : -1;
+	return (x->acquisitions < y->acquisitions) ? 1 : (x->acquisitions > y->acquisitions) ? -1 : 0;
+}
+
+void lock_stats_dump()
+{
+#define LOCK_STATS_SHOWN 30
+	/* Merge the per-core tables */
+	lock_stats_t* all = calloc(cpu_cores()*LOCK_STATS_SLOTS, sizeof(lock_stats_t));
+	uint n = 0;
+	unsigned long lost = 0;
+	for(uint c=0; c<cpu_cores(); c++) {
+		lost += lock_stats_lost[c];
+		for(uint i=0; i<LOCK_STATS_SLOTS; i++) {
+			lock_stats_t* ls = & lock_stats_table[c][i];
+			if(ls->lock == NULL) continue;
+			uint j;
+			for(j=0; j<n; j++)
+				if(all[j].lock == ls->lock && all[j].kind == ls->kind) break;
+			if(j == n) 
+				all[n++] = *ls;
+			else {
+				all[j].acquisitions += ls->acquisitions;
+				all[j].contended += ls->contended;
+				all[j].spins += ls->spins;
+				all[j].sleeps += ls->sleeps;
+				all[j].wait_ns += ls->wait_ns;
+			}
+		}
+	}
+	qsort(all, n, sizeof(lock_stats_t), by_wait_time);
+
+	fprintf(stderr, "Lock statistics (%u locks, most waiting first):\n", n);
+	fprintf(stderr, "%-14s %-18s %-18s %12s %10s %12s %8s %12s\n",
+		"kind", "name", "lock", "acquired", "contended", "spins", "sleeps", "wait(usec)");
+	for(uint i=0; i<n && i<LOCK_STATS_SHOWN; i++) {
+		const char* name = lock_name(all[i].lock);
+		char site[32];
+		if(name == NULL) {
+			snprintf(site, sizeof(site), "at %p", all[i].site);
+			name = site;
+		}
+		fprintf(stderr, "%-14s %-18s %-18p %12lu %10lu %12lu %8lu %12.1f\n",
+			all[i].kind, name, all[i].lock, all[i].acquisitions, all[i].contended,
+			all[i].spins, all[i].sleeps, all[i].wait_ns/1000.0);
+	}
+	if(lost)
+		fprintf(stderr, "(%lu acquisitions not recorded, the tables were full)\n", lost);
+
+	free(all);
+#undef LOCK_STATS_SHOWN
+}
+
+#endif
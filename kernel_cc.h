@@ -33,52 +33,218 @@
 
 
 /*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+ * Kernel semaphores.
  */
 
 /**
-	@brief Lock the kernel.
+	@brief A kernel semaphore.
+
+	A kernel semaphore is a binary semaphore, implemented as a monitor,
+	which is used to lock a kernel subsystem in the preemptive domain.
+	Unlike a @c Mutex, a thread that contends for a kernel semaphore sleeps 
+	instead of spinning, and the internal mutex is held for a very short time,
+	regardless of contention.
+
+	Waiters are queued in FIFO order, and unlocking hands the semaphore 
+	directly to the oldest waiter, which is woken up exactly once. Thus,
+	a woken thread never has to compete again for the semaphore, and
+	waiters do not form a convoy.
+
+	A thread holding a kernel semaphore can wait on a condition variable,
+	releasing the semaphore atomically (see @c ksem_wait_wchan).
+
+	The kernel is locked by subsystem: 
+	- the process table lock, for processes and threads
+	- the file table lock, for file ids and FCBs
+	- one lock per polling instance
+	- the port map lock, for sockets
+	- one lock per pipe
+	- one lock per serial device (held by readers)
+
+	When more than one is needed, they are taken in this order; the
+	file table lock is a leaf.
+
+	@see KSEM_INIT
  */
-void kernel_lock();
+typedef struct kernel_semaphore {
+	Mutex mx;		/**< @brief The monitor mutex */
+	int count;		/**< @brief The semaphore counter */
+	void* waitq;	/**< @brief Threads waiting for the semaphore, oldest first */
+	TCB* owner;		/**< @brief The thread holding the semaphore, if known */
+} ksem_t;
+
+/** @brief The initializer for an unlocked kernel semaphore */
+#define KSEM_INIT ((ksem_t){ .mx = { 0, NULL, NULL, NULL }, .count = 1, .waitq = NULL, .owner = NULL })
+
+/**
+	@brief Lock a kernel semaphore, sleeping as long as needed.
+ */
+void ksem_lock(ksem_t* sem);
 
 /**
-	@brief Unlock the kernel.
+	@brief Unlock a kernel semaphore.
  */
-void kernel_unlock();
+void ksem_unlock(ksem_t* sem);
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable, releasing a locked kernel semaphore.
+
+	The semaphore is re-locked before returning.
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int ksem_wait_wchan(ksem_t* sem, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define ksem_wait(sem, cv, cause) \
+	ksem_wait_wchan((sem),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define ksem_timedwait(sem, cv, cause, timeout) \
+	ksem_wait_wchan((sem),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
-	@brief Signal a kernel condition to one waiter.
+	@brief Put thread to sleep, unlocking a locked kernel semaphore.
 
-	This call must be made 
+	This is the analogue of @c sleep_releasing for kernel semaphores.
   */
-void kernel_signal(CondVar* cv);
+void ksem_sleep(ksem_t* sem, Thread_state state, enum SCHED_CAUSE cause);
+
 
 /**
-	@brief Signal a kernel condition to all waiters.
-  */
-void kernel_broadcast(CondVar* cv);
+	@brief A kernel reader-writer lock.
+
+	Any number of readers, or a single writer, may hold the lock. Waiting
+	writers take precedence over new readers, so that writers are not 
+	starved. Both readers and writers sleep while they wait.
+
+	@see KRWLOCK_INIT
+ */
+typedef struct kernel_rwlock {
+	Mutex mx;				/**< @brief The monitor mutex */
+	int readers;			/**< @brief Number of readers holding the lock, or -1 for a writer */
+	int writers_waiting;	/**< @brief Number of writers waiting for the lock */
+	CondVar readers_cv;		/**< @brief Readers waiting for the lock */
+	CondVar writers_cv;		/**< @brief Writers waiting for the lock */
+} krwlock_t;
+
+/** @brief The initializer for an unlocked reader-writer lock */
+#define KRWLOCK_INIT ((krwlock_t){ .mx = { 0, NULL, NULL, NULL }, .readers = 0, .writers_waiting = 0, \
+	.readers_cv = { NULL, { 0, NULL, NULL, NULL } }, .writers_cv = { NULL, { 0, NULL, NULL, NULL } } })
+
+/** @brief Lock a reader-writer lock for reading. */
+void krw_read_lock(krwlock_t* rw);
+
+/** @brief Release a reader-writer lock held for reading. */
+void krw_read_unlock(krwlock_t* rw);
+
+/** @brief Lock a reader-writer lock for writing. */
+void krw_write_lock(krwlock_t* rw);
+
+/** @brief Release a reader-writer lock held for writing. */
+void krw_write_unlock(krwlock_t* rw);
 
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Enter an RCU read section.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
-  */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+	Read-copy-update lets readers traverse shared data without taking any lock.
+	Writers publish changes with @c rcu_assign_pointer, and before reclaiming
+	an object that readers may still see, they call @c rcu_synchronize, or
+	they defer it until a grace period started with @c rcu_gp_start is over.
+
+	A read section disables preemption on the current core, therefore it must
+	be short and must not sleep. Read sections may nest.
+
+	@see rcu_read_unlock
+	@see rcu_synchronize
+ */
+void rcu_read_lock();
+
+/** @brief Leave an RCU read section. */
+void rcu_read_unlock();
+
+/**
+	@brief Wait until all RCU read sections that are in progress have ended.
+
+	After this call returns, no reader can hold a pointer to data that was
+	unpublished before the call. It must not be called from inside a read section.
+ */
+void rcu_synchronize();
+
+/**
+	@brief A grace period, for reclaiming objects without waiting for it.
+
+	@see rcu_gp_start
+	@see rcu_gp_done
+ */
+typedef struct { unsigned long seq[MAX_CORES]; } rcu_gp;
+
+/**
+	@brief Start a grace period.
+
+	Objects unpublished before this call can be reclaimed once @c rcu_gp_done
+	returns true for @c gp.
+ */
+void rcu_gp_start(rcu_gp* gp);
+
+/** @brief Return true if the read sections in progress when @c gp started have ended. */
+int rcu_gp_done(rcu_gp* gp);
+
+/** @brief Load an RCU-protected pointer, inside a read section. */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/** @brief Publish an RCU-protected pointer. */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+
+/**
+	@brief Lock statistics.
+
+	Build with @c make LOCK_STATS=1 to record statistics for every mutex, 
+	kernel semaphore and condition variable: the number of acquisitions 
+	(or waits, for condition variables), how many of them were contended, 
+	how many times the contended ones spun and slept, and the total time 
+	they waited. Each core counts into its own table, so recording does not
+	add contention of its own. The tables are merged by @c lock_stats_dump, 
+	which prints them when the VM shuts down.
+
+	Locks are identified by address. Important kernel locks are given a 
+	name with @c lock_stats_name; other locks are shown with the call site 
+	of their first acquisition.
+ */
+#ifndef LOCK_STATS
+#define LOCK_STATS 0
+#endif
+
+#if LOCK_STATS
+
+/** @brief The statistics of a lock. */
+typedef struct lock_stats {
+	const void* lock;				/**< @brief The lock address */
+	const char* kind;				/**< @brief The kind of lock */
+	void* site;						/**< @brief The call site of the first acquisition */
+	unsigned long acquisitions;		/**< @brief Number of acquisitions */
+	unsigned long contended;		/**< @brief Acquisitions that had to wait */
+	unsigned long spins;			/**< @brief Total spin iterations */
+	unsigned long sleeps;			/**< @brief Total times the waiters slept */
+	unsigned long wait_ns;			/**< @brief Total waiting time in nanoseconds */
+} lock_stats_t;
+
+/** @brief Give a name to a lock, for the statistics report. */
+void lock_stats_name(const void* lock, const char* name);
+
+/** 
+	@brief Get the statistics of a lock of the given kind, merged over all cores.
+	@returns 1 if the lock has been used, 0 otherwise
+ */
+int lock_stats_get(const void* lock, const char* kind, lock_stats_t* stats);
+
+/** @brief Print the statistics of the most contended locks to @c stderr. */
+void lock_stats_dump();
+
+#else
+
+#define lock_stats_name(lock, name)
+
+#endif
 
 
 
@@ -15,6 +15,82 @@
 DCB DT[MAX_TERMINALS];
 
 
+/* ===================================
+
+  Poll wait queues
+
+  ====================================*/
+
+/* 
+  The lock of all wait queues. It is held with preemption off, since the
+  serial driver notifies from its interrupt handler.
+ */
+static Mutex poll_lock = MUTEX_INIT;
+
+void poll_wq_init(poll_wq* wq)
+{
+  rlnode_init(&wq->hooks, NULL);
+}
+
+void poll_wait(poll_wq* wq, poll_table* pt)
+{
+  if(pt == NULL) return;
+  assert(pt->used < POLL_MAX_HOOKS);
+  poll_hook* hook = &pt->hooks[pt->used++];
+
+  int pre = preempt_off;
+  Mutex_Lock(&poll_lock);
+  hook->wq = wq;
+  rlist_push_back(&wq->hooks, &hook->node);
+  Mutex_Unlock(&poll_lock);
+  if(pre) preempt_on;
+}
+
+void poll_unwait(poll_table* pt)
+{
+  int pre = preempt_off;
+  Mutex_Lock(&poll_lock);
+  for(unsigned int i=0; i<pt->used; i++) {
+    poll_hook* hook = &pt->hooks[i];
+    if(hook->wq) {
+      rlist_remove(&hook->node);
+      hook->wq = NULL;
+    }
+  }
+  pt->used = 0;
+  Mutex_Unlock(&poll_lock);
+  if(pre) preempt_on;
+}
+
+void poll_notify(poll_wq* wq, int events)
+{
+  /* A watcher that registers concurrently computes the readiness itself */
+  if(is_rlist_empty(&wq->hooks)) return;
+
+  int pre = preempt_off;
+  Mutex_Lock(&poll_lock);
+  for(rlnode* p = wq->hooks.next; p != &wq->hooks; p = p->next) {
+    poll_hook* hook = (poll_hook*)p;
+    hook->notify(hook, events);
+  }
+  Mutex_Unlock(&poll_lock);
+  if(pre) preempt_on;
+}
+
+void poll_wq_destroy(poll_wq* wq, int events)
+{
+  int pre = preempt_off;
+  Mutex_Lock(&poll_lock);
+  while(! is_rlist_empty(&wq->hooks)) {
+    poll_hook* hook = (poll_hook*) rlist_pop_front(&wq->hooks);
+    hook->wq = NULL;
+    hook->notify(hook, events);
+  }
+  Mutex_Unlock(&poll_lock);
+  if(pre) preempt_on;
+}
+
+
 /* ===================================
 
   The null device driver
@@ -42,6 +118,11 @@ int nulldev_close(void* dev)
   return 0;
 }
 
+int nulldev_poll(void* dev, poll_table* pt)
+{
+  return EPOLLIN | EPOLLOUT;
+}
+
 void* nulldev_open(uint minor)
 {
   return NULL;
@@ -51,7 +132,8 @@ static file_ops nulldev_fops = {
   .Open = nulldev_open,
   .Read = nulldev_read,
   .Write = nulldev_write,
-  .Close = nulldev_close
+  .Close = nulldev_close,
+  .Poll = nulldev_poll
 };
 
 
@@ -69,7 +151,11 @@ void serial_tx_handler();
 typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
+  ksem_t rx_lock;   /* Serializes readers */
   CondVar rx_ready;
+  int peeked;       /* A byte was read ahead by serial_poll */
+  char peek;        /* ... and this is it */
+  poll_wq poll;
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -91,6 +177,7 @@ void serial_rx_handler()
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
     Cond_Broadcast(&dcb->rx_ready);
+    poll_notify(&dcb->poll, EPOLLIN);
   }
   if(pre) preempt_on;
 }
@@ -102,10 +189,16 @@ int serial_read(void* dev, char *buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  ksem_lock(&dcb->rx_lock);
   preempt_off;            /* Stop preemption */
 
   uint count =  0;
 
+  if(dcb->peeked && size>0) {
+    buf[count++] = dcb->peek;
+    dcb->peeked = 0;
+  }
+
   while(count<size) {
     int valid = bios_read_serial(dcb->devno, &buf[count]);
     
@@ -113,15 +206,17 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      if(stream_nonblocking()) break;
+      ksem_wait(&dcb->rx_lock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
   preempt_on;           /* Restart preemption */
+  ksem_unlock(&dcb->rx_lock);
 
-  return count;
+  return (count==0 && size>0) ? WOULDBLOCK : count;
 }
 
 
@@ -152,6 +247,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
     } 
     else if(count==0)
     {
+      if(stream_nonblocking()) return WOULDBLOCK;
       yield(SCHED_IO);
     }
     else
@@ -168,6 +264,29 @@ int serial_close(void* dev)
 }
 
 
+/*
+  The device cannot tell if there is input without reading it, so a byte
+  is read ahead and kept for the next read. Writes are polled, hence the 
+  device is always writable.
+ */
+int serial_poll(void* dev, poll_table* pt)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  ksem_lock(&dcb->rx_lock);
+  poll_wait(&dcb->poll, pt);
+
+  int pre = preempt_off;
+  if(! dcb->peeked)
+    dcb->peeked = bios_read_serial(dcb->devno, &dcb->peek);
+  int events = EPOLLOUT | (dcb->peeked ? EPOLLIN : 0);
+  if(pre) preempt_on;
+
+  ksem_unlock(&dcb->rx_lock);
+  return events;
+}
+
+
 void* serial_open(uint term)
 {
   assert(term<bios_serial_ports());
@@ -180,7 +299,8 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .Poll = serial_poll
 };
 
 
@@ -211,6 +331,9 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].rx_lock = KSEM_INIT;
+    serial_dcb[i].peeked = 0;
+    poll_wq_init(&serial_dcb[i].poll);
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -34,6 +34,83 @@
 */
 
 
+/**
+  @brief A poll wait queue.
+
+  A stream object that can be polled keeps a wait queue, where watchers 
+  (see @c EpollCtl) register a @c poll_hook through the @c Poll method.
+  The stream calls @c poll_notify on it when its readiness may have changed.
+
+  All wait queues are protected by a single spinlock, taken with preemption
+  off, so that @c poll_notify can be called from an interrupt handler.
+ */
+typedef struct poll_wait_queue {
+  rlnode hooks;		/**< @brief The registered @c poll_hook objects */
+} poll_wq;
+
+
+/**
+  @brief A watcher's entry in a poll wait queue.
+
+  The @c obj field of @c node is set by the watcher.
+ */
+typedef struct poll_hook {
+  rlnode node;				/**< @brief Node in the wait queue */
+  poll_wq* wq;				/**< @brief The wait queue, or NULL if detached */
+
+  /** @brief Called with the poll events that may have occurred. 
+
+    This is called with the wait queue lock held and preemption off.
+    It must not block.
+   */
+  void (*notify)(struct poll_hook* hook, int events);
+} poll_hook;
+
+
+/** @brief The maximum number of wait queues a stream registers with. */
+#define POLL_MAX_HOOKS 2
+
+/**
+  @brief The registration argument of the @c Poll method.
+
+  A watcher passes an array of unused hooks; the stream fills one 
+  for each of its wait queues, by calling @c poll_wait.
+ */
+typedef struct poll_table {
+  poll_hook* hooks;		/**< @brief The hooks to fill */
+  unsigned int used;	/**< @brief The number of hooks filled so far */
+} poll_table;
+
+
+/** @brief Initialize a wait queue. */
+void poll_wq_init(poll_wq* wq);
+
+/** 
+  @brief Register the next hook of a poll table with a wait queue.
+
+  This is called by the @c Poll methods. If @c pt is NULL, nothing is done.
+ */
+void poll_wait(poll_wq* wq, poll_table* pt);
+
+/** @brief Remove the hooks of a poll table from their wait queues. */
+void poll_unwait(poll_table* pt);
+
+/** 
+  @brief Notify the watchers of a wait queue. 
+
+  This is cheap when nobody watches, so it can be called on every change.
+ */
+void poll_notify(poll_wq* wq, int events);
+
+/** 
+  @brief Detach all watchers from a wait queue, before it is destroyed. 
+
+  The watchers are first notified with @c events. 
+ */
+void poll_wq_destroy(poll_wq* wq, int events);
+
+
+
 /**
   @brief The device-specific file operations table.
 
@@ -92,6 +169,18 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Poll operation.
+
+      Return the current readiness of the stream, as a mask of @c EPOLLIN, 
+      @c EPOLLOUT, @c EPOLLHUP and @c EPOLLERR. If @c pt is not NULL, also
+      register it with the wait queues of the stream (see @c poll_wait),
+      before the readiness is computed, so that no change is missed.
+
+      This function returns -1 if the stream cannot be polled. It may be
+      NULL, for streams that never support polling.
+     */
+    int (*Poll)(void* this, poll_table* pt);
 } file_ops;
 
 
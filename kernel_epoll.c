@@ -0,0 +1,392 @@
+#include "tinyos.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+
+/*
+  Polling instances.
+
+  An instance keeps one item per watched file id. Each item registers its
+  hooks with the wait queues of the stream, through the Poll method, and the
+  notifications of the stream put the item on the ready list of the instance.
+  EpollWait only visits the ready list: it polls each item again, reports it
+  if it is still ready and, in level-triggered mode, keeps it on the list for
+  the next call.
+
+  An item does not keep its stream open. It also hooks to the watchers of
+  the FCB, which are notified when the stream is closed. The item then
+  forgets the FCB and goes on the ready list, where it is dropped. To poll
+  the stream, a reference is taken under the ready lock, unless the FCB is
+  being released. An item whose file id no longer refers to its FCB is
+  dropped as well, when it is found ready or when EpollCtl is called for
+  the file id.
+
+  The instance semaphore serializes EpollCtl and the scans of EpollWait. It
+  is taken before the stream locks, which the Poll methods take. The ready
+  lock protects the ready list. The notifications take it under the wait
+  queue lock, so it is a spinlock, held with preemption off.
+ */
+
+/** \cond HELPER Helper structures for polling. */
+typedef struct epoll_item {
+	struct epoll_control_block* ep;
+	Fid_t fd;							/* the watched file id */
+	FCB* fcb;							/* the stream, NULL once closed */
+	int events;							/* the watched events and flags */
+	poll_hook hooks[POLL_MAX_HOOKS];
+	poll_table pt;						/* the hooks in use */
+	poll_hook close_hook;				/* in the watchers of the FCB */
+	poll_table close_pt;
+	rlnode ready_node;					/* in the ready list */
+	int ready;							/* set while in a ready list */
+} epoll_item;
+
+typedef struct epoll_control_block {
+	ksem_t lock;
+	epoll_item* items[MAX_FILEID];		/* the items, by file id */
+	Mutex ready_lock;					/* held with preemption off */
+	rlnode ready;						/* the ready items */
+	CondVar has_ready;
+} epoll_cb;
+/** \endcond */
+
+/* These events are watched for every stream */
+#define EPOLL_ALWAYS (EPOLLHUP | EPOLLERR)
+
+
+/* Put an item on the ready list, unless it is there already */
+static void epoll_mark_ready(epoll_item* item)
+{
+	epoll_cb* ep = item->ep;
+	int pre = preempt_off;
+	Mutex_Lock(& ep->ready_lock);
+	if(! item->ready) {
+		int was_empty = is_rlist_empty(& ep->ready);
+		item->ready = 1;
+		rlist_push_back(& ep->ready, & item->ready_node);
+		if(was_empty) Cond_Broadcast(& ep->has_ready);
+	}
+	Mutex_Unlock(& ep->ready_lock);
+	if(pre) preempt_on;
+}
+
+/* The notify callback of the hooks */
+static void epoll_notify(poll_hook* hook, int events)
+{
+	epoll_item* item = hook->node.obj;
+	if(events & (item->events | EPOLL_ALWAYS))
+		epoll_mark_ready(item);
+}
+
+/* The notify callback of the close hook */
+static void epoll_closed(poll_hook* hook, int events)
+{
+	epoll_item* item = hook->node.obj;
+	epoll_cb* ep = item->ep;
+	Mutex_Lock(& ep->ready_lock);
+	item->fcb = NULL;
+	Mutex_Unlock(& ep->ready_lock);
+	epoll_mark_ready(item);
+}
+
+/* Return a reference to the stream of an item, or NULL if it is closed */
+static FCB* epoll_stream(epoll_item* item)
+{
+	epoll_cb* ep = item->ep;
+	int pre = preempt_off;
+	Mutex_Lock(& ep->ready_lock);
+	FCB* fcb = item->fcb;
+	if(fcb && ! FCB_tryref(fcb)) fcb = NULL;
+	Mutex_Unlock(& ep->ready_lock);
+	if(pre) preempt_on;
+	return fcb;
+}
+
+/* Poll the stream of an item, returning the events of interest */
+static int epoll_poll(epoll_item* item, FCB* fcb, poll_table* pt)
+{
+	int revents = fcb->streamfunc->Poll(fcb->streamobj, pt);
+	return (revents < 0) ? revents : revents & (item->events | EPOLL_ALWAYS);
+}
+
+
+/* The caller holds a reference to fcb, the stream of fd */
+static int epoll_add(epoll_cb* ep, Fid_t fd, FCB* fcb, int events)
+{
+	if(fcb->streamfunc->Poll == NULL) return -1;
+
+	epoll_item* item = (epoll_item*) xmalloc(sizeof(epoll_item));
+	item->ep = ep;
+	item->fd = fd;
+	item->fcb = fcb;
+	item->events = events;
+	for(int i=0; i<POLL_MAX_HOOKS; i++) {
+		rlnode_init(& item->hooks[i].node, item);
+		item->hooks[i].wq = NULL;
+		item->hooks[i].notify = epoll_notify;
+	}
+	item->pt = (poll_table){ .hooks = item->hooks, .used = 0 };
+	rlnode_init(& item->close_hook.node, item);
+	item->close_hook.wq = NULL;
+	item->close_hook.notify = epoll_closed;
+	item->close_pt = (poll_table){ .hooks = & item->close_hook, .used = 0 };
+	rlnode_init(& item->ready_node, item);
+	item->ready = 0;
+
+	/* Register first, then check, so that no change is missed */
+	poll_wait(& fcb->watchers, & item->close_pt);
+	int revents = epoll_poll(item, fcb, & item->pt);
+	if(revents < 0) {
+		poll_unwait(& item->pt);
+		poll_unwait(& item->close_pt);
+		free(item);
+		return -1;
+	}
+
+	ep->items[fd] = item;
+	if(revents) epoll_mark_ready(item);
+	return 0;
+}
+
+
+static void epoll_remove(epoll_cb* ep, epoll_item* item)
+{
+	/* After this, no notification can reach the item */
+	poll_unwait(& item->pt);
+	poll_unwait(& item->close_pt);
+
+	int pre = preempt_off;
+	Mutex_Lock(& ep->ready_lock);
+	if(item->ready) rlist_remove(& item->ready_node);
+	Mutex_Unlock(& ep->ready_lock);
+	if(pre) preempt_on;
+
+	ep->items[item->fd] = NULL;
+	free(item);
+}
+
+
+/*
+  Report up to max ready items. Each item is taken off the ready list and
+  polled, and a level-triggered item that is still ready is put back at the
+  end, so that the items are reported round-robin.
+ */
+static int epoll_harvest(epoll_cb* ep, epoll_event* events, int max)
+{
+	rlnode again;
+	rlnode_init(& again, NULL);
+
+	int n = 0;
+	while(n < max) {
+		epoll_item* item = NULL;
+
+		int pre = preempt_off;
+		Mutex_Lock(& ep->ready_lock);
+		if(! is_rlist_empty(& ep->ready)) {
+			item = rlist_pop_front(& ep->ready)->obj;
+			item->ready = 0;
+		}
+		Mutex_Unlock(& ep->ready_lock);
+		if(pre) preempt_on;
+
+		if(item == NULL) break;
+
+		FCB* fcb = epoll_stream(item);
+		if(fcb == NULL || fcb != get_fcb(item->fd)) {
+			/* The stream was closed, or the file id was */
+			if(fcb) FCB_decref(fcb);
+			epoll_remove(ep, item);
+			continue;
+		}
+		int revents = epoll_poll(item, fcb, NULL);
+		FCB_decref(fcb);
+		if(revents <= 0) continue;
+
+		events[n].fd = item->fd;
+		events[n].events = revents;
+		n++;
+
+		if(item->events & EPOLLET) continue;
+
+		/* A notification may have put it back already */
+		pre = preempt_off;
+		Mutex_Lock(& ep->ready_lock);
+		if(! item->ready) {
+			item->ready = 1;
+			rlist_push_back(& again, & item->ready_node);
+		}
+		Mutex_Unlock(& ep->ready_lock);
+		if(pre) preempt_on;
+	}
+
+	if(! is_rlist_empty(& again)) {
+		int pre = preempt_off;
+		Mutex_Lock(& ep->ready_lock);
+		while(! is_rlist_empty(& again))
+			rlist_push_back(& ep->ready, rlist_pop_front(& again));
+		Cond_Broadcast(& ep->has_ready);
+		Mutex_Unlock(& ep->ready_lock);
+		if(pre) preempt_on;
+	}
+
+	return n;
+}
+
+
+/* Wait until the ready list is not empty, or the deadline passes */
+static void epoll_await(epoll_cb* ep, TimerDuration deadline)
+{
+	int pre = preempt_off;
+	Mutex_Lock(& ep->ready_lock);
+	while(is_rlist_empty(& ep->ready)) {
+		if(deadline == NO_TIMEOUT) {
+			Cond_Wait(& ep->ready_lock, & ep->has_ready);
+		}
+		else {
+			TimerDuration now = bios_clock();
+			if(now >= deadline) break;
+			Cond_TimedWait(& ep->ready_lock, & ep->has_ready, (deadline - now + 999)/1000);
+		}
+	}
+	Mutex_Unlock(& ep->ready_lock);
+	if(pre) preempt_on;
+}
+
+
+
+static int epoll_read(void* this, char* buf, unsigned int size)
+{
+	return -1;
+}
+
+static int epoll_write(void* this, const char* buf, unsigned int size)
+{
+	return -1;
+}
+
+static int epoll_close(void* this)
+{
+	epoll_cb* ep = (epoll_cb*) this;
+	for(Fid_t fd=0; fd<MAX_FILEID; fd++)
+		if(ep->items[fd]) epoll_remove(ep, ep->items[fd]);
+	free(ep);
+	return 0;
+}
+
+/* An instance cannot be watched, so there is no Poll method */
+static file_ops epoll_file_ops = {
+	.Read = epoll_read,
+	.Write = epoll_write,
+	.Close = epoll_close
+};
+
+
+/* Return the instance of epfd and a reference to its FCB, or NULL */
+static epoll_cb* get_epoll_ref(Fid_t epfd, FCB** fcb)
+{
+	*fcb = get_fcb_ref(epfd);
+	if(*fcb == NULL) return NULL;
+	if((*fcb)->streamfunc != &epoll_file_ops) {
+		FCB_decref(*fcb);
+		return NULL;
+	}
+	return (*fcb)->streamobj;
+}
+
+
+
+Fid_t sys_EpollCreate()
+{
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb)) return NOFILE;
+
+	epoll_cb* ep = (epoll_cb*) xmalloc(sizeof(epoll_cb));
+	ep->lock = KSEM_INIT;
+	for(Fid_t fd=0; fd<MAX_FILEID; fd++) ep->items[fd] = NULL;
+	ep->ready_lock = MUTEX_INIT;
+	rlnode_init(& ep->ready, NULL);
+	ep->has_ready = COND_INIT;
+
+	fcb->streamobj = ep;
+	fcb->streamfunc = &epoll_file_ops;
+	return fid;
+}
+
+
+int sys_EpollCtl(Fid_t epfd, epoll_op op, Fid_t fd, int events)
+{
+	if(fd < 0 || fd >= MAX_FILEID) return -1;
+	if(events & ~(EPOLLIN | EPOLLOUT | EPOLL_ALWAYS | EPOLLET)) return -1;
+
+	FCB* epfcb;
+	epoll_cb* ep = get_epoll_ref(epfd, &epfcb);
+	if(ep == NULL) return -1;
+
+	FCB* fcb = get_fcb_ref(fd);
+
+	int ret = -1;
+	ksem_lock(& ep->lock);
+	epoll_item* item = ep->items[fd];
+	if(item != NULL && __atomic_load_n(& item->fcb, __ATOMIC_RELAXED) != fcb) {
+		/* The file id was closed, and maybe reused, without EPOLL_CTL_DEL */
+		epoll_remove(ep, item);
+		item = NULL;
+	}
+	if(fcb != NULL) switch(op) {
+	case EPOLL_CTL_ADD:
+		if(item == NULL)
+			ret = epoll_add(ep, fd, fcb, events);
+		break;
+	case EPOLL_CTL_MOD:
+		if(item != NULL) {
+			item->events = events;
+			if(epoll_poll(item, fcb, NULL) > 0) epoll_mark_ready(item);
+			ret = 0;
+		}
+		break;
+	case EPOLL_CTL_DEL:
+		if(item != NULL) {
+			epoll_remove(ep, item);
+			ret = 0;
+		}
+		break;
+	}
+	ksem_unlock(& ep->lock);
+
+	if(fcb != NULL) FCB_decref(fcb);
+	FCB_decref(epfcb);
+	return ret;
+}
+
+
+int sys_EpollWait(Fid_t epfd, epoll_event* events, int maxevents, timeout_t timeout)
+{
+	if(events == NULL || maxevents <= 0) return -1;
+
+	FCB* epfcb;
+	epoll_cb* ep = get_epoll_ref(epfd, &epfcb);
+	if(ep == NULL) return -1;
+
+	TimerDuration deadline;
+	if(timeout == 0) deadline = NO_TIMEOUT;
+	else if(timeout == EPOLL_NOWAIT) deadline = 0;
+	else deadline = bios_clock() + timeout*1000ul;
+
+	int n;
+	ksem_lock(& ep->lock);
+	for(;;) {
+		n = epoll_harvest(ep, events, maxevents);
+		if(n > 0) break;
+		if(deadline != NO_TIMEOUT && bios_clock() >= deadline) break;
+
+		/* Let EpollCtl run while we sleep */
+		ksem_unlock(& ep->lock);
+		epoll_await(ep, deadline);
+		ksem_lock(& ep->lock);
+	}
+	ksem_unlock(& ep->lock);
+
+	FCB_decref(epfcb);
+	return n;
+}
@@ -0,0 +1,184 @@
+#include "tinyos.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+#include "kernel_futex.h"
+
+
+/** \cond HELPER Helper structures for futexes. */
+typedef struct futex_bucket {
+	Mutex lock;			/* held with preemption off */
+	rlnode waiters;		/* futex_waiter nodes, in FIFO order */
+} futex_bucket;
+
+typedef struct futex_waiter {
+	rlnode node;			/* in the bucket list */
+	volatile int* addr;		/* the address waited on */
+	TCB* thread;			/* the waiting thread */
+	int woken;				/* set by WakeAddress */
+} futex_waiter;
+/** \endcond */
+
+
+static futex_bucket futex_table[FUTEX_BUCKETS];
+
+static inline futex_bucket* bucket_of(volatile int* addr)
+{
+	uintptr_t a = (uintptr_t) addr;
+	return & futex_table[((a >> 2) ^ (a >> 12)) % FUTEX_BUCKETS];
+}
+
+
+void initialize_futexes()
+{
+	for(unsigned int i=0; i<FUTEX_BUCKETS; i++) {
+		futex_table[i].lock = MUTEX_INIT;
+		rlnode_init(& futex_table[i].waiters, NULL);
+	}
+}
+
+
+/* Returns 1 if woken up by futex_wake, 0 if not, and -1 if *addr != expected */
+static int futex_wait(volatile int* addr, int expected, TimerDuration timeout)
+{
+	futex_bucket* b = bucket_of(addr);
+	futex_waiter waiter = { .addr = addr, .thread = cur_thread(), .woken = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	/* Checking the value under the bucket lock makes the check-and-sleep
+	   atomic with respect to WakeAddress */
+	if(*addr != expected) {
+		Mutex_Unlock(& b->lock);
+		if(preempt) preempt_on;
+		return -1;
+	}
+
+	rlist_push_back(& b->waiters, & waiter.node);
+	sleep_releasing(STOPPED, & b->lock, SCHED_USER, timeout);
+
+	/* If we were not woken, we are still in the list */
+	Mutex_Lock(& b->lock);
+	if(! waiter.woken)
+		rlist_remove(& waiter.node);
+	Mutex_Unlock(& b->lock);
+
+	if(preempt) preempt_on;
+	return waiter.woken;
+}
+
+static int futex_wake(volatile int* addr, int n)
+{
+	futex_bucket* b = bucket_of(addr);
+	int count = 0;
+
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	rlnode* p = b->waiters.next;
+	while(p != &b->waiters && (n < 0 || count < n)) {
+		futex_waiter* w = p->obj;
+		p = p->next;
+		if(w->addr == addr) {
+			rlist_remove(& w->node);
+			w->woken = 1;
+			wakeup(w->thread);
+			count++;
+		}
+	}
+
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+	return count;
+}
+
+
+int sys_WaitOnAddress(volatile int* addr, int expected, timeout_t timeout)
+{
+	if(addr == NULL) return -1;
+	return futex_wait(addr, expected, (timeout==0) ? NO_TIMEOUT : timeout*1000ul)==1 ? 0 : -1;
+}
+
+int sys_WakeAddress(volatile int* addr, int n)
+{
+	if(addr == NULL) return 0;
+	return futex_wake(addr, n);
+}
+
+
+/*
+	Spin while *addr == val, and return 1 if it changed. Spinning only helps
+	when the thread that will change *addr is running on another core; we stop
+	as soon as some thread is waiting for our own core, as it may be that one.
+ */
+static int sync_spin(volatile int* addr, int val)
+{
+	if(cpu_cores() == 1) return 0;
+	for(int i=0; i<SYNC_SPINS; i++) {
+		if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) != val) return 1;
+		if(__atomic_load_n(& cctx[cpu_core_id].ready_count, __ATOMIC_RELAXED) > 0) break;
+#if defined(__x86__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+	return __atomic_load_n(addr, __ATOMIC_ACQUIRE) != val;
+}
+
+
+int sys_SemaphoreDown(Semaphore* sem, timeout_t timeout)
+{
+	if(sem == NULL) return -1;
+	TimerDuration deadline = (timeout==0) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+
+	for(;;) {
+		int c = __atomic_load_n(& sem->count, __ATOMIC_RELAXED);
+		while(c > 0)
+			if(__atomic_compare_exchange_n(& sem->count, &c, c-1, 0, 
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return 0;
+
+		if(sync_spin(& sem->count, c)) continue;
+
+		TimerDuration wait = NO_TIMEOUT;
+		if(deadline != NO_TIMEOUT) {
+			TimerDuration now = bios_clock();
+			if(now >= deadline) return -1;
+			wait = deadline - now;
+		}
+
+		/* SemaphoreUp checks sleepers after it increments count */
+		__atomic_add_fetch(& sem->sleepers, 1, __ATOMIC_SEQ_CST);
+		futex_wait(& sem->count, c, wait);
+		__atomic_sub_fetch(& sem->sleepers, 1, __ATOMIC_RELAXED);
+	}
+}
+
+int sys_SemaphoreUp(Semaphore* sem)
+{
+	if(sem == NULL) return -1;
+	__atomic_add_fetch(& sem->count, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(& sem->sleepers, __ATOMIC_SEQ_CST) > 0)
+		futex_wake(& sem->count, 1);
+	return 0;
+}
+
+
+int sys_BarrierWait(Barrier* bar, unsigned int n)
+{
+	if(bar == NULL || n == 0) return -1;
+
+	int epoch = __atomic_load_n(& bar->epoch, __ATOMIC_ACQUIRE);
+	if(__atomic_add_fetch(& bar->arrived, 1, __ATOMIC_ACQ_REL) == (int) n) {
+		/* The last one to arrive starts the next phase */
+		__atomic_store_n(& bar->arrived, 0, __ATOMIC_RELAXED);
+		__atomic_add_fetch(& bar->epoch, 1, __ATOMIC_RELEASE);
+		futex_wake(& bar->epoch, -1);
+		return 1;
+	}
+
+	while(__atomic_load_n(& bar->epoch, __ATOMIC_ACQUIRE) == epoch)
+		if(! sync_spin(& bar->epoch, epoch))
+			futex_wait(& bar->epoch, epoch, NO_TIMEOUT);
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef __KERNEL_FUTEX_H
+#define __KERNEL_FUTEX_H
+
+#include "tinyos.h"
+
+/**
+	@file kernel_futex.h
+	@brief Waiting on user addresses.
+
+	@defgroup futex Futexes.
+	@ingroup kernel
+	@brief Waiting on user addresses.
+
+	The @c WaitOnAddress and @c WakeAddress system calls let user code block
+	on an integer in memory, in the manner of Linux futexes. Waiting threads
+	are kept in a fixed table of buckets, hashed by address. Each bucket has
+	its own spinlock, so unrelated addresses rarely contend.
+
+	The @c Semaphore and @c Barrier system calls are built on the same 
+	buckets. Before sleeping, a waiter spins for up to @c SYNC_SPINS 
+	iterations, as long as no other thread is ready to run on its core.
+
+	@{
+*/
+
+/** @brief The number of wait buckets. */
+#define FUTEX_BUCKETS 256
+
+/** @brief The spin budget of semaphore and barrier waiters, before they sleep. */
+#ifndef SYNC_SPINS
+#define SYNC_SPINS 2000
+#endif
+
+/** 
+  @brief Initialization for futexes.
+
+  This function is called at kernel startup.
+ */
+void initialize_futexes();
+
+/** @} */
+
+#endif
@@ -9,6 +9,8 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_futex.h"
+#include "kernel_cc.h"
 
 
 
@@ -38,6 +40,7 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
+    initialize_futexes();
     initialize_scheduler();
 
     /* The boot task is executed normally! */
@@ -53,6 +56,12 @@ void boot_tinyos_kernel()
 
   run_scheduler();
 
+#if LOCK_STATS
+  cpu_core_barrier_sync();
+  if(cpu_core_id==0)
+    lock_stats_dump();
+#endif
+
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
   }
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "tinyos.h"
 #include "kernel_pipe.h"
 #include "kernel_proc.h"
@@ -36,88 +37,136 @@ int pipe_read_dummy(void* this, char* buf, unsigned int size){
 int pipe_write(void* pipecb_t, const char *buf, unsigned int n){
 
   pipe_cb* pipecb = (pipe_cb*)pipecb_t;
-  int i;
-  
-  if(pipecb->reader==NULL)
-    return -1;
 
-  while(pipecb->empty_slots == 0)
-    kernel_wait(&pipecb->has_space, SCHED_USER);
+  ksem_lock(&pipecb->lock);
 
- for(i=0; i<n; i++){
-
-  pipecb->BUFFER[pipecb->w_position] = buf[i];
-  
-  if(pipecb->w_position == PIPE_BUFFER_SIZE-1)
-      pipecb->w_position=0;
-  else
-    pipecb->w_position++;
+  while(pipecb->head - pipecb->tail == pipecb->capacity && pipecb->reader!=NULL && pipecb->writer!=NULL) {
+    if(stream_nonblocking()) {
+      ksem_unlock(&pipecb->lock);
+      return WOULDBLOCK;
+    }
+    ksem_wait(&pipecb->lock, &pipecb->has_space, SCHED_USER);
+  }
 
-  pipecb->empty_slots = pipecb->empty_slots - 1;
-    
-  if(pipecb->empty_slots == 0){
-    kernel_broadcast(&pipecb->has_data);
-      return i+1;
+  /* The reader is gone, or our end was shut down meanwhile */
+  if(pipecb->reader==NULL || pipecb->writer==NULL) {
+    ksem_unlock(&pipecb->lock);
+    return -1;
   }
 
- }
- 
- kernel_broadcast(&pipecb->has_data);
- return i;
- 
+  /* Copy as much as fits, in at most two segments: up to the end of the ring and from its start */
+  unsigned int size = pipecb->capacity;
+  unsigned int used = pipecb->head - pipecb->tail;
+  unsigned int count = (n < size - used) ? n : size - used;
+  unsigned int pos = pipecb->head & (size-1);
+  unsigned int first = (count < size - pos) ? count : size - pos;
+
+  memcpy(pipecb->BUFFER + pos, buf, first);
+  memcpy(pipecb->BUFFER, buf + first, count - first);
+  pipecb->head += count;
+  if(count > 0)
+    poll_notify(&pipecb->poll, EPOLLIN);
+
+  /* Readers only wait on an empty pipe. Wake them up after unlocking, else they may preempt us and block on the lock */
+  ksem_unlock(&pipecb->lock);
+  if(used == 0 && count > 0)
+    Cond_Broadcast(&pipecb->has_data);
+  return count;
 }
 
 int pipe_read(void* pipecb_t, char* buf, unsigned int n){
 
   pipe_cb* pipecb = (pipe_cb*)pipecb_t;
-  int i;
 
+  ksem_lock(&pipecb->lock);
 
-if(pipecb->empty_slots==PIPE_BUFFER_SIZE && pipecb->writer==NULL)
-  return 0;
-
+  while(pipecb->head == pipecb->tail && pipecb->writer!=NULL && pipecb->reader!=NULL) {
+    if(stream_nonblocking()) {
+      ksem_unlock(&pipecb->lock);
+      return WOULDBLOCK;
+    }
+    ksem_wait(&pipecb->lock, &pipecb->has_data, SCHED_USER);
+  }
 
-while(pipecb->empty_slots==PIPE_BUFFER_SIZE)
-    kernel_wait(&pipecb->has_data, SCHED_USER);
+  /* Our end was shut down meanwhile */
+  if(pipecb->reader == NULL) {
+    ksem_unlock(&pipecb->lock);
+    return -1;
+  }
 
-  for(i=0; i<n; i++){
-     
-    buf[i] = pipecb->BUFFER[pipecb->r_position];
-    
-    if(pipecb->r_position==PIPE_BUFFER_SIZE-1){
-        pipecb->r_position=0;
+  /* End of file */
+  if(pipecb->head == pipecb->tail) {
+    ksem_unlock(&pipecb->lock);
+    return 0;
   }
-    else
-        pipecb->r_position++;
-    
-      pipecb->empty_slots = pipecb->empty_slots + 1;
 
-    if(pipecb->empty_slots==PIPE_BUFFER_SIZE){
-        kernel_broadcast(&pipecb->has_space);
-        return i+1;
-    }
+  unsigned int size = pipecb->capacity;
+  unsigned int used = pipecb->head - pipecb->tail;
+  unsigned int count = (n < used) ? n : used;
+  unsigned int pos = pipecb->tail & (size-1);
+  unsigned int first = (count < size - pos) ? count : size - pos;
+
+  memcpy(buf, pipecb->BUFFER + pos, first);
+  memcpy(buf + first, pipecb->BUFFER, count - first);
+  pipecb->tail += count;
+  if(count > 0)
+    poll_notify(&pipecb->poll, EPOLLOUT);
+
+  /* Writers only wait on a full pipe. Wake them up after unlocking, else they may preempt us and block on the lock */
+  ksem_unlock(&pipecb->lock);
+  if(used == size && count > 0)
+    Cond_Broadcast(&pipecb->has_space);
+  return count;
+}
 
-  }
-  
-  kernel_broadcast(&pipecb->has_space);
-  return i;
+static void pipe_free(pipe_cb* pipecb){
+  poll_wq_destroy(&pipecb->poll, EPOLLHUP);
+  free(pipecb->BUFFER);
+  free(pipecb);
+}
+
+/* 
+  Keep the pipe of a socket alive during an operation. The caller must 
+  ensure that the pipe cannot be freed meanwhile, e.g., by holding the 
+  port map lock while the pipe is attached to the socket.
+ */
+void pipe_pin(pipe_cb* pipecb){
+  ksem_lock(&pipecb->lock);
+  pipecb->pins++;
+  ksem_unlock(&pipecb->lock);
+}
 
+void pipe_unpin(pipe_cb* pipecb){
+  ksem_lock(&pipecb->lock);
+  pipecb->pins--;
+  int last = (pipecb->pins==0 && pipecb->reader==NULL && pipecb->writer==NULL);
+  ksem_unlock(&pipecb->lock);
 
+  if(last)
+    pipe_free(pipecb);
 }
 
 int pipe_writer_close(void* _pipecb){
 
 
 pipe_cb* pipecb = (pipe_cb*)_pipecb;
- if(pipecb->writer == NULL && pipecb->reader == NULL)
+ksem_lock(&pipecb->lock);
+ if(pipecb->writer == NULL && pipecb->reader == NULL) {
+   ksem_unlock(&pipecb->lock);
    return 0;
+ }
 
 pipecb->writer = NULL;
-if(pipecb->reader==NULL){
- free(pipecb);
- pipecb = NULL;
-
-}
+/* Readers must see the end of file, and writers blocked on a shut down
+   socket must fail */
+Cond_Broadcast(&pipecb->has_data);
+Cond_Broadcast(&pipecb->has_space);
+poll_notify(&pipecb->poll, EPOLLIN|EPOLLHUP);
+int last = (pipecb->reader==NULL && pipecb->pins==0);
+ksem_unlock(&pipecb->lock);
+
+if(last)
+ pipe_free(pipecb);
 return 0;
 
 }
@@ -126,18 +175,103 @@ int pipe_reader_close(void* _pipecb){
 
 
 pipe_cb* pipecb = (pipe_cb*)_pipecb;
- if(pipecb->writer == NULL && pipecb->reader == NULL)
+ksem_lock(&pipecb->lock);
+ if(pipecb->writer == NULL && pipecb->reader == NULL) {
+   ksem_unlock(&pipecb->lock);
    return 0;
+ }
 
 
 pipecb->reader = NULL;
-if(pipecb->writer==NULL){
- free(pipecb);
- pipecb = NULL;
+/* Writers must fail, and so must readers blocked on a shut down socket */
+Cond_Broadcast(&pipecb->has_space);
+Cond_Broadcast(&pipecb->has_data);
+poll_notify(&pipecb->poll, EPOLLOUT|EPOLLERR);
+int last = (pipecb->writer==NULL && pipecb->pins==0);
+ksem_unlock(&pipecb->lock);
+
+if(last)
+ pipe_free(pipecb);
+return 0;
+
 }
 
-return 0;
 
+/* 
+  The read end is ready when there is data, or at end of file; the write 
+  end is ready when there is space, or when writes fail.
+ */
+int pipe_reader_poll(void* _pipecb, poll_table* pt){
+
+  pipe_cb* pipecb = (pipe_cb*)_pipecb;
+
+  ksem_lock(&pipecb->lock);
+  poll_wait(&pipecb->poll, pt);
+  int events = 0;
+  if(pipecb->head != pipecb->tail) events |= EPOLLIN;
+  if(pipecb->writer == NULL) events |= EPOLLIN | EPOLLHUP;
+  ksem_unlock(&pipecb->lock);
+  return events;
+}
+
+int pipe_writer_poll(void* _pipecb, poll_table* pt){
+
+  pipe_cb* pipecb = (pipe_cb*)_pipecb;
+
+  ksem_lock(&pipecb->lock);
+  poll_wait(&pipecb->poll, pt);
+  int events = 0;
+  if(pipecb->head - pipecb->tail < pipecb->capacity) events |= EPOLLOUT;
+  if(pipecb->reader == NULL) events |= EPOLLOUT | EPOLLERR;
+  ksem_unlock(&pipecb->lock);
+  return events;
+}
+
+
+/* Move the contents to a new buffer of the given capacity */
+int pipe_capacity(pipe_cb* pipecb, int capacity){
+
+  if(capacity < 0 || capacity > PIPE_MAX_CAPACITY)
+    return -1;
+
+  ksem_lock(&pipecb->lock);
+
+  unsigned int size = pipecb->capacity;
+  unsigned int used = pipecb->head - pipecb->tail;
+  unsigned int newsize = PIPE_MIN_CAPACITY;
+  while(newsize < (unsigned int)capacity)
+    newsize <<= 1;
+
+  if(capacity == 0 || newsize == size) {
+    ksem_unlock(&pipecb->lock);
+    return size;
+  }
+  if(used > newsize) {
+    ksem_unlock(&pipecb->lock);
+    return -1;
+  }
+
+  /* Copy out in at most two segments, as in pipe_read */
+  char* buffer = (char*)xmalloc(newsize);
+  unsigned int pos = pipecb->tail & (size-1);
+  unsigned int first = (used < size - pos) ? used : size - pos;
+  memcpy(buffer, pipecb->BUFFER + pos, first);
+  memcpy(buffer + first, pipecb->BUFFER, used - first);
+
+  free(pipecb->BUFFER);
+  pipecb->BUFFER = buffer;
+  pipecb->capacity = newsize;
+  pipecb->tail = 0;
+  pipecb->head = used;
+
+  ksem_unlock(&pipecb->lock);
+
+  /* Writers waiting on a full pipe may continue */
+  if(used == size && newsize > size) {
+    Cond_Broadcast(&pipecb->has_space);
+    poll_notify(&pipecb->poll, EPOLLOUT);
+  }
+  return newsize;
 }
 
 
@@ -145,7 +279,8 @@ file_ops reader_file_ops = {
   .Open = pipe_open_dummy,
   .Read = pipe_read,
   .Write = pipe_write_dummy,
-  .Close = pipe_reader_close
+  .Close = pipe_reader_close,
+  .Poll = pipe_reader_poll
 };
 
 
@@ -153,7 +288,8 @@ file_ops writer_file_ops = {
   .Open = pipe_open_dummy,
   .Read = pipe_read_dummy,
   .Write = pipe_write,
-  .Close = pipe_writer_close
+  .Close = pipe_writer_close,
+  .Poll = pipe_writer_poll
 };
 
 
@@ -164,11 +300,15 @@ pipe_cb* initialize_pipe_cb(){
   pipe_cb* pipecb =(pipe_cb*)xmalloc(sizeof(pipe_cb)); 
   pipecb->reader = NULL;
   pipecb->writer = NULL;
+  pipecb->lock = KSEM_INIT;
   pipecb->has_data = COND_INIT;
   pipecb->has_space = COND_INIT;
-  pipecb->w_position = 0;
-  pipecb->r_position = 0;
-  pipecb->empty_slots = PIPE_BUFFER_SIZE;
+  pipecb->head = 0;
+  pipecb->tail = 0;
+  pipecb->capacity = PIPE_BUFFER_SIZE;
+  pipecb->BUFFER = (char*)xmalloc(PIPE_BUFFER_SIZE);
+  poll_wq_init(&pipecb->poll);
+  pipecb->pins = 0;
   return pipecb;
 }
 
@@ -197,4 +337,201 @@ int sys_Pipe(pipe_t* pipe){
   
   return 0;
 
-}
\ No newline at end of file
+}
+
+
+int sys_PipeCapacity(Fid_t fid, int capacity){
+
+  FCB* fcb = get_fcb_ref(fid);
+  if(fcb == NULL)
+    return -1;
+
+  int ret;
+  if(fcb->streamfunc == &reader_file_ops || fcb->streamfunc == &writer_file_ops)
+    ret = pipe_capacity(fcb->streamobj, capacity);
+  else
+    ret = socket_capacity(fcb, capacity);
+
+  FCB_decref(fcb);
+  return ret;
+}
+
+
+
+/* Lock two pipes in address order, so that opposite splices do not deadlock */
+static void pipe_lock_pair(pipe_cb* a, pipe_cb* b){
+  if(a > b) { pipe_cb* t = a; a = b; b = t; }
+  ksem_lock(&a->lock);
+  ksem_lock(&b->lock);
+}
+
+/*
+  Move up to n bytes from the ring of src to the ring of dst. When all of
+  src goes into an empty dst of the same capacity, the buffers are swapped
+  instead of copied. Otherwise, the bytes are copied once, ring to ring, 
+  instead of twice through a user buffer.
+ */
+static int pipe_splice(pipe_cb* src, pipe_cb* dst, unsigned int n, int nonblock_in, int nonblock_out){
+
+  if(src == dst)
+    return -1;
+
+  unsigned int avail, room;
+  for(;;) {
+    pipe_lock_pair(src, dst);
+
+    /* Our ends were shut down, or the reader is gone, as in pipe_read and pipe_write */
+    if(src->reader == NULL || dst->writer == NULL || dst->reader == NULL) {
+      ksem_unlock(&src->lock);
+      ksem_unlock(&dst->lock);
+      return -1;
+    }
+
+    avail = src->head - src->tail;
+    room = dst->capacity - (dst->head - dst->tail);
+    if(avail > 0 && room > 0)
+      break;
+
+    /* End of file */
+    if(avail == 0 && src->writer == NULL) {
+      ksem_unlock(&src->lock);
+      ksem_unlock(&dst->lock);
+      return 0;
+    }
+
+    /* Wait holding only the lock of the pipe we wait on */
+    if(avail == 0) {
+      ksem_unlock(&dst->lock);
+      if(nonblock_in) {
+        ksem_unlock(&src->lock);
+        return WOULDBLOCK;
+      }
+      ksem_wait(&src->lock, &src->has_data, SCHED_USER);
+      ksem_unlock(&src->lock);
+    } else {
+      ksem_unlock(&src->lock);
+      if(nonblock_out) {
+        ksem_unlock(&dst->lock);
+        return WOULDBLOCK;
+      }
+      ksem_wait(&dst->lock, &dst->has_space, SCHED_USER);
+      ksem_unlock(&dst->lock);
+    }
+  }
+
+  unsigned int count = n;
+  if(count > avail) count = avail;
+  if(count > room) count = room;
+
+  if(count == avail && room == dst->capacity && src->capacity == dst->capacity) {
+    /* Take over the whole ring of src; the counters keep their positions */
+    char* buffer = dst->BUFFER;
+    dst->BUFFER = src->BUFFER;
+    dst->tail = src->tail;
+    dst->head = src->head;
+    src->BUFFER = buffer;
+    src->tail = src->head;
+  } else {
+    /* Copy in segments that are contiguous in both rings */
+    for(unsigned int done = 0; done < count; ) {
+      unsigned int spos = src->tail & (src->capacity-1);
+      unsigned int dpos = dst->head & (dst->capacity-1);
+      unsigned int chunk = count - done;
+      if(chunk > src->capacity - spos) chunk = src->capacity - spos;
+      if(chunk > dst->capacity - dpos) chunk = dst->capacity - dpos;
+      memcpy(dst->BUFFER + dpos, src->BUFFER + spos, chunk);
+      src->tail += chunk;
+      dst->head += chunk;
+      done += chunk;
+    }
+  }
+
+  poll_notify(&src->poll, EPOLLOUT);
+  poll_notify(&dst->poll, EPOLLIN);
+  int src_was_full = (avail == src->capacity);
+  int dst_was_empty = (room == dst->capacity);
+  ksem_unlock(&src->lock);
+  ksem_unlock(&dst->lock);
+
+  if(src_was_full)
+    Cond_Broadcast(&src->has_space);
+  if(dst_was_empty)
+    Cond_Broadcast(&dst->has_data);
+  return count;
+}
+
+
+/*
+  The pipe that a stream reads from (or writes to), or NULL. A pipe end is kept
+  alive by our reference to its FCB; the pipe of a socket can be dropped by
+  ShutDown, so it is returned pinned.
+ */
+static pipe_cb* stream_pipe(FCB* fcb, int write){
+  if(fcb->streamfunc == (write ? &writer_file_ops : &reader_file_ops))
+    return fcb->streamobj;
+  return socket_pipe(fcb, write);
+}
+
+
+/*
+  Splice through a kernel buffer, for other streams. The data that was read
+  is always written out, so the output is written in blocking mode.
+ */
+static int stream_splice(FCB* in, FCB* out, unsigned int n){
+
+  if(in->streamfunc->Read == NULL || out->streamfunc->Write == NULL)
+    return -1;
+
+  char buf[SPLICE_CHUNK];
+  if(n > SPLICE_CHUNK) n = SPLICE_CHUNK;
+
+  int io = stream_begin_io(in);
+  int count = in->streamfunc->Read(in->streamobj, buf, n);
+  stream_end_io(io);
+
+  io = stream_begin_io_flags(0);
+  int done = 0;
+  while(done < count) {
+    int rc = out->streamfunc->Write(out->streamobj, buf + done, count - done);
+    if(rc <= 0) break;
+    done += rc;
+  }
+  stream_end_io(io);
+
+  if(count <= 0)
+    return count;
+  return (done > 0) ? done : -1;
+}
+
+
+int sys_Splice(Fid_t fd_in, Fid_t fd_out, unsigned int len){
+
+  FCB* in = get_fcb_ref(fd_in);
+  if(in == NULL)
+    return -1;
+  FCB* out = get_fcb_ref(fd_out);
+  if(out == NULL) {
+    FCB_decref(in);
+    return -1;
+  }
+
+  int ret = 0;
+  if(len > 0) {
+    pipe_cb* src = stream_pipe(in, 0);
+    pipe_cb* dst = stream_pipe(out, 1);
+    if(src != NULL && dst != NULL)
+      ret = pipe_splice(src, dst, len, in->flags & FD_NONBLOCK, out->flags & FD_NONBLOCK);
+    else if(in->streamfunc == &writer_file_ops || out->streamfunc == &reader_file_ops
+            || (src == NULL && in->streamfunc == &socket_file_ops)
+            || (dst == NULL && out->streamfunc == &socket_file_ops))
+      ret = -1;   /* Do not consume input that cannot be written */
+    else
+      ret = stream_splice(in, out, len);
+    if(src && in->streamfunc == &socket_file_ops) pipe_unpin(src);
+    if(dst && out->streamfunc == &socket_file_ops) pipe_unpin(dst);
+  }
+
+  FCB_decref(out);
+  FCB_decref(in);
+  return ret;
+}
@@ -4,32 +4,58 @@
 
 #include "tinyos.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
-#define PIPE_BUFFER_SIZE 4000
+/* The pipe buffer is a ring, whose capacity is a power of two. This is the
+   initial capacity; it can be changed by PipeCapacity() */
+#define PIPE_BUFFER_SIZE 4096
+#define PIPE_MIN_CAPACITY 256
+
+/* Splice() between other streams copies through a stack buffer of this size */
+#define SPLICE_CHUNK 1024
 
 typedef struct struct_pipe_control_block{
 
 FCB *reader , *writer ;
 
+ksem_t lock; /* Protects the pipe, including the fields above */
+
 CondVar has_space; /*For writer  */
 CondVar has_data ; /*For reader */
 
-int w_position , r_position ;
+/* Free-running counters of the bytes written and read; they index the
+   ring modulo capacity, and head - tail bytes are in the pipe */
+unsigned int head , tail ;
+
+char* BUFFER;
+unsigned int capacity;
 
-char BUFFER[PIPE_BUFFER_SIZE];
+poll_wq poll; /* Watchers of either end */
 
-int empty_slots;
+/* Socket operations in progress; the pipe is freed when both ends are 
+   closed and it is not pinned */
+unsigned int pins;
 
 
 }pipe_cb;
 
 
 pipe_cb* initialize_pipe_cb();
+void pipe_pin(pipe_cb* pipecb);
+void pipe_unpin(pipe_cb* pipecb);
 int sys_Pipe(pipe_t* pipe);
 int pipe_reader_close(void* _pipecb);
 int pipe_writer_close(void* _pipecb);
 int pipe_read(void* pipecb_t, char* buf, unsigned int n);
 int pipe_write(void* pipecb_t, const char *buf, unsigned int n);
+int pipe_reader_poll(void* _pipecb, poll_table* pt);
+int pipe_writer_poll(void* _pipecb, poll_table* pt);
+int pipe_capacity(pipe_cb* pipecb, int capacity);
+int socket_capacity(FCB* fcb, int capacity);
+pipe_cb* socket_pipe(FCB* fcb, int write);
+extern file_ops socket_file_ops;
+int sys_PipeCapacity(Fid_t fid, int capacity);
+int sys_Splice(Fid_t fd_in, Fid_t fd_out, unsigned int len);
 int do_nothing();
 void* do_nothing_pt();
 
@@ -22,6 +22,9 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* The process table lock */
+ksem_t proc_lock = KSEM_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -58,6 +61,7 @@ static PCB* pcb_freelist;
 
 void initialize_processes()
 {
+  lock_stats_name(&proc_lock, "proc_lock");
   /* initialize the PCBs */
   for(Pid_t p=0; p<MAX_PROC; p++) {
     initialize_PCB(&PT[p]);
@@ -82,7 +86,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
@@ -99,7 +103,7 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -166,8 +170,21 @@ PTCB* initialize_ptcb(){
 	System call to create a new process.
  */
 Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return sys_ExecStack(call, argl, args, 0);
+}
+
+/*
+	System call to create a new process, with a given stack size for the main thread.
+ */
+Pid_t sys_ExecStack(Task call, int argl, void* args, unsigned int stack_size)
 {
   PCB *curproc, *newproc;
+
+  if(stack_size != 0 && stack_size < THREAD_STACK_MIN)
+    return NOPROC;
+
+  ksem_lock(&proc_lock);
   
   /* The new process PCB */
   newproc = acquire_PCB();
@@ -190,9 +207,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
     /* Inherit file streams from parent */
     for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
+       newproc->FIDT[i] = get_fcb_ref(i);
     }
   }
 
@@ -217,19 +232,24 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   if(call != NULL) { //new new new new new
     
     PTCB* ptcb = initialize_ptcb();
-    ptcb->tcb = spawn_thread(newproc, ptcb, start_main_thread);
+    ptcb->tcb = spawn_thread(newproc, ptcb, start_main_thread, stack_size);
     rlist_push_front(&newproc->ptcb_list, &ptcb->ptcb_list_node);
     ptcb->task = newproc->main_task;
     ptcb->argl = newproc->argl;
     ptcb->args = newproc->args;
     newproc->thread_count++;
     newproc->main_thread=ptcb->tcb;
-    wakeup(ptcb->tcb);
      
   }
 
 
 finish:
+  ksem_unlock(&proc_lock);
+
+  /* Wake up the main thread after unlocking, else it may preempt us and block on the lock */
+  if(newproc != NULL && call != NULL)
+    wakeup(newproc->main_thread);
+
   return get_pid(newproc);
 }
 
@@ -243,7 +263,10 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  ksem_lock(&proc_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  ksem_unlock(&proc_lock);
+  return ppid;
 }
 
 
@@ -278,7 +301,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    ksem_wait(&proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -302,7 +325,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    ksem_wait(&proc_lock, & parent->child_exit, SCHED_USER);    
   }
 
   if(no_children)
@@ -319,15 +342,19 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  ksem_lock(&proc_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
 
+  ksem_unlock(&proc_lock);
+  return cpid;
 }
 
 
@@ -357,13 +384,18 @@ int procinfo_read(void* _procinfo_cb, char* buf, unsigned int size){
 
   procinfo_cb* procinfocb = (procinfo_cb*)_procinfo_cb;
 
+  ksem_lock(&proc_lock);
+
   while(procinfocb->PCB_cursor < MAX_PROC &&
     PT[procinfocb->PCB_cursor].pstate == FREE){
 
       procinfocb->PCB_cursor++;
 
   }
-  if(procinfocb->PCB_cursor==MAX_PROC) return 0;
+  if(procinfocb->PCB_cursor==MAX_PROC) {
+    ksem_unlock(&proc_lock);
+    return 0;
+  }
 
   PCB* pcb = &PT[procinfocb->PCB_cursor];
 
@@ -392,6 +424,8 @@ int procinfo_read(void* _procinfo_cb, char* buf, unsigned int size){
   memcpy(buf, (char*)&procinfocb->info, sizeof(procinfo));
 
   procinfocb->PCB_cursor++;
+
+  ksem_unlock(&proc_lock);
   return 1;
 }
 
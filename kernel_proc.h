@@ -17,6 +17,7 @@
 
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_cc.h"
 #include "kernel_thread.h"
 #include "kernel_pipe.h"
 
@@ -115,6 +116,7 @@ typedef struct process_thread_control_block {
 typedef struct listener_socket{
   rlnode queue;
   CondVar req_available;
+  poll_wq poll;
 }listener_socket;
 
 
@@ -182,6 +184,15 @@ void start_thread();
 */
 PTCB* initialize_ptcb();
 
+/**
+  @brief The process table lock.
+
+  This kernel semaphore protects the process table, the process tree,
+  and the threads (PTCBs) of all processes. 
+  It is taken by the process and thread system calls.
+*/
+extern ksem_t proc_lock;
+
 /**
   @brief Initialize the process table.
 
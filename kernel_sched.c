@@ -55,27 +55,33 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 architecture, the stack grows downward. Therefore, we
+  allocate the TCB above the memory block used as the stack, and a 
+  guard page below it.
 
-  +-------------+
+  +-------------+  high addresses
   |   TCB       |
   +-------------+
+  | first frame |
+  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
-  +-------------+
-  | first frame |
   +-------------+
+  | guard page  |  (PROT_NONE)
+  +-------------+  low addresses
 
   Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  hit the guard page and crash with a segmentation fault, before it corrupts
+  any other memory.
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
+
+  The memory is mapped with MAP_NORESERVE, so that stack pages are only 
+  committed when they are first touched.
  */
 
 /*
@@ -92,39 +98,57 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (SYSTEM_PAGE_SIZE + (stack_size) + THREAD_TCB_SIZE)
+
+/* The start of the memory block of a thread */
+#define THREAD_BLOCK(tcb) (((void*)(tcb)) - (tcb)->stack_size - SYSTEM_PAGE_SIZE)
 
-//#define MMAPPED_THREAD_MEM
+#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. Stack pages are committed lazily.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+static void free_thread(TCB* tcb) { CHECK(munmap(THREAD_BLOCK(tcb), THREAD_SIZE(tcb->stack_size))); }
 
-void* allocate_thread(size_t size)
+static TCB* allocate_thread(size_t stack_size)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	void* ptr = mmap(NULL, THREAD_SIZE(stack_size), PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
 
-	return ptr;
+	/* Set up the guard page */
+	CHECK(mprotect(ptr, SYSTEM_PAGE_SIZE, PROT_NONE));
+
+	TCB* tcb = (TCB*)(ptr + SYSTEM_PAGE_SIZE + stack_size);
+	tcb->stack_size = stack_size;
+	return tcb;
 }
 #else
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
+  Use malloc to allocate a thread. The whole block is committed by the 
+  allocator.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+static void free_thread(TCB* tcb) 
+{
+	void* ptr = THREAD_BLOCK(tcb);
+	CHECK(mprotect(ptr, SYSTEM_PAGE_SIZE, PROT_READ | PROT_WRITE));
+	free(ptr); 
+}
 
-void* allocate_thread(size_t size)
+static TCB* allocate_thread(size_t stack_size)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
+	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, THREAD_SIZE(stack_size));
 	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+
+	/* Set up the guard page */
+	CHECK(mprotect(ptr, SYSTEM_PAGE_SIZE, PROT_NONE));
+
+	TCB* tcb = (TCB*)(ptr + SYSTEM_PAGE_SIZE + stack_size);
+	tcb->stack_size = stack_size;
+	return tcb;
 }
 #endif
 
@@ -150,10 +174,43 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb,PTCB* ptcb, void (*func)())
+/*
+  Get a TCB+stack block from the pool of the current core, or else 
+  allocate a new one. Only blocks with the default stack size are pooled.
+ */
+static TCB* acquire_TCB(size_t stack_size)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	if (stack_size != THREAD_STACK_SIZE)
+		return allocate_thread(stack_size);
+
+	int preempt = preempt_off;
+
+	CCB* ccb = &CURCORE;
+	TCB* tcb = NULL;
+	if (ccb->thread_pool_size > 0) {
+		tcb = rlist_pop_front(&ccb->thread_pool)->tcb;
+		ccb->thread_pool_size--;
+		ccb->thread_pool_hits++;
+	} else
+		ccb->thread_pool_misses++;
+
+	if (preempt)
+		preempt_on;
+
+	if (tcb == NULL)
+		tcb = allocate_thread(THREAD_STACK_SIZE);
+	return tcb;
+}
+
+TCB* spawn_thread(PCB* pcb,PTCB* ptcb, void (*func)(), size_t stack_size)
+{
+	/* The allocated stack size must be a multiple of page size */
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_SIZE;
+	stack_size = ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+	assert(stack_size >= THREAD_STACK_MIN);
+
+	TCB* tcb = acquire_TCB(stack_size);
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -166,22 +223,31 @@ TCB* spawn_thread(PCB* pcb,PTCB* ptcb, void (*func)())
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
-	tcb->priority = PQ - 1; // New: Start new threads at lowest priority 
+	tcb->priority = PQ - 1; /* Start new threads at the top level */ 
+	tcb->inherited_priority = -1;
+	for (int p = 0; p < PQ; p++)
+		tcb->lenders[p] = 0;
+	tcb->lock_waiter = NULL;
+	tcb->held_mutexes = 0;
+	tcb->io_flags = 0;
+	tcb->core = cpu_core_id; /* Start at the core of the creator */
+	tcb->boost_epoch = cctx[tcb->core].boost_epoch;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
+	tcb->allotment_used = 0;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = ((void*)tcb) - tcb->stack_size;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, tcb->stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + tcb->stack_size);
 #endif
 
 	/* increase the count of active threads */
@@ -193,7 +259,7 @@ TCB* spawn_thread(PCB* pcb,PTCB* ptcb, void (*func)())
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called with the sched_lock of the current core locked !
  */
 void release_TCB(TCB* tcb)
 {
@@ -201,13 +267,179 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	/* Keep the block in the pool of this core, unless it is full. A thread
+	   that exited holding a mutex is left in place for good, since the waiters
+	   at the mutex still look at it. */
+	CCB* ccb = &CURCORE;
+	if (tcb->held_mutexes > 0) {
+		/* Leaked */
+	} else if (tcb->stack_size != THREAD_STACK_SIZE) {
+		/* The pool only holds blocks of the default size */
+		free_thread(tcb);
+	} else if (ccb->thread_pool_size < THREAD_POOL_HIGH_WATER) {
+		rlnode_init(&tcb->sched_node, tcb);
+		rlist_push_front(&ccb->thread_pool, &tcb->sched_node);
+		ccb->thread_pool_size++;
+	} else {
+		free_thread(tcb);
+		ccb->thread_pool_overflows++;
+	}
 
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads--;
 	Mutex_Unlock(&active_threads_spinlock);
 }
 
+/*
+ *
+ * Timeouts
+ *
+ */
+
+#define TW_MASK (TIMER_WHEEL_SIZE - 1)
+#define TW_RANGE ((TimerDuration)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+/* The tick of a timestamp, rounded up */
+static inline TimerDuration tw_tick_of(TimerDuration t)
+{
+	return (t + (1ull << TIMER_WHEEL_TICK_SHIFT) - 1) >> TIMER_WHEEL_TICK_SHIFT;
+}
+
+void timer_wheel_init(timer_wheel* tw, TimerDuration now)
+{
+	tw->tick = now >> TIMER_WHEEL_TICK_SHIFT;
+	tw->count = 0;
+	for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		tw->occupied[l] = 0;
+		for (int i = 0; i < TIMER_WHEEL_SIZE; i++)
+			rlnode_init(&tw->slot[l][i], NULL);
+	}
+}
+
+/* Queue a thread into the slot that covers its wakeup tick */
+static void tw_enqueue(timer_wheel* tw, TCB* tcb)
+{
+	TimerDuration expires = tw_tick_of(tcb->wakeup_time);
+	if (expires < tw->tick)
+		expires = tw->tick;
+	if (expires - tw->tick >= TW_RANGE)
+		expires = tw->tick + TW_RANGE - 1;
+
+	TimerDuration delta = expires - tw->tick;
+	int level = 0;
+	while (delta >= ((TimerDuration)1 << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+
+	uint idx = (expires >> (TIMER_WHEEL_BITS * level)) & TW_MASK;
+	rlist_push_back(&tw->slot[level][idx], &tcb->sched_node);
+	tw->occupied[level] |= 1ull << idx;
+}
+
+void timer_wheel_insert(timer_wheel* tw, TCB* tcb)
+{
+	assert(tcb->wakeup_time != NO_TIMEOUT);
+	tw_enqueue(tw, tcb);
+	tw->count++;
+}
+
+void timer_wheel_remove(timer_wheel* tw, TCB* tcb)
+{
+	/* The occupied bit of the slot is cleared lazily, by timer_wheel_advance() */
+	rlist_remove(&tcb->sched_node);
+	tw->count--;
+}
+
+/* Re-queue the threads of a slot relative to the current tick */
+static void tw_cascade(timer_wheel* tw, int level, uint idx)
+{
+	rlnode* slot = &tw->slot[level][idx];
+	tw->occupied[level] &= ~(1ull << idx);
+
+	/* Detach the whole list, since threads may return to this slot */
+	rlnode list;
+	rlnode_init(&list, NULL);
+	rlist_append(&list, slot);
+
+	while (!is_rlist_empty(&list))
+		tw_enqueue(tw, rlist_pop_front(&list)->tcb);
+}
+
+void timer_wheel_advance(timer_wheel* tw, TimerDuration now, rlnode* expired)
+{
+	TimerDuration last = now >> TIMER_WHEEL_TICK_SHIFT;
+
+	while (tw->tick <= last) {
+		if (tw->count == 0) {
+			tw->tick = last + 1;
+			break;
+		}
+
+		TimerDuration tick = tw->tick;
+		uint idx = tick & TW_MASK;
+
+		/* At the start of a rotation, cascade the current slots of the upper levels */
+		for (int l = 1; l < TIMER_WHEEL_LEVELS; l++) {
+			if ((tick >> (TIMER_WHEEL_BITS * (l - 1))) & TW_MASK)
+				break;
+			tw_cascade(tw, l, (tick >> (TIMER_WHEEL_BITS * l)) & TW_MASK);
+		}
+
+		/* Every thread in the current slot of level 0 expires at this tick */
+		if (tw->occupied[0] & (1ull << idx)) {
+			rlnode* slot = &tw->slot[0][idx];
+			while (!is_rlist_empty(slot)) {
+				TCB* tcb = rlist_pop_front(slot)->tcb;
+				tcb->wakeup_time = NO_TIMEOUT;
+				rlist_push_back(expired, &tcb->sched_node);
+				tw->count--;
+			}
+			tw->occupied[0] &= ~(1ull << idx);
+		}
+
+		/* Skip to the next occupied slot of level 0, or the end of the rotation */
+		uint64_t ahead = (idx == TW_MASK) ? 0 : tw->occupied[0] & (~0ull << (idx + 1));
+		TimerDuration next = tick - idx + (ahead ? __builtin_ctzll(ahead) : TIMER_WHEEL_SIZE);
+		tw->tick = (next <= last) ? next : last + 1;
+	}
+}
+
+/* Rotate a slot bitmap right */
+static inline uint64_t tw_rotr(uint64_t mask, uint n)
+{
+	return (mask >> n) | (mask << ((64 - n) & 63));
+}
+
+TimerDuration timer_wheel_next(timer_wheel* tw)
+{
+	if (tw->count == 0)
+		return NO_TIMEOUT;
+
+	TimerDuration next = NO_TIMEOUT;
+	for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		TimerDuration base = tw->tick >> (TIMER_WHEEL_BITS * l);
+		uint64_t occ = tw_rotr(tw->occupied[l], base & TW_MASK);
+		if (occ == 0)
+			continue;
+
+		/* 
+		  The distance of the first occupied slot. At upper levels, the current
+		  slot is cascaded at the start of its span; if that has passed, it will
+		  next be cascaded after a full rotation.
+		 */
+		uint dist;
+		if (l == 0 || (base << (TIMER_WHEEL_BITS * l)) == tw->tick)
+			dist = __builtin_ctzll(occ);
+		else
+			dist = (occ & ~1ull) ? __builtin_ctzll(occ & ~1ull) : TIMER_WHEEL_SIZE;
+
+		TimerDuration tick = (base + dist) << (TIMER_WHEEL_BITS * l);
+		if (tick < next)
+			next = tick;
+	}
+	return next << TIMER_WHEEL_TICK_SHIFT;
+}
+
+
 /*
  *
  * Scheduler
@@ -219,84 +451,205 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  Each core has its own scheduler data, stored in its CCB: a set of 
+  MLFQ ready queues (implemented as doubly linked lists) and a timer
+  wheel holding the sleeping threads with a timeout.
+
+  Every thread is owned by some core (field @c core of the TCB). The 
+  scheduler data of a core, as well as the state of the threads owned by it,
+  are protected by the core's @c sched_lock. Therefore, cores only
+  contend when a thread owned by one core is woken up by another, or
+  when an idle core steals work from a busy one.
+
+  Locking order: a core may hold its own @c sched_lock and then try to
+  acquire the lock of some other core, but only by @c sched_trylock().
 */
 
-rlnode SCHED[PQ]; /* The scheduler queue */ // NEW
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
-
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
-/* Interrupt handle for inter-core interrupts */
+/* 
+  Interrupt handler for inter-core interrupts.
+
+  An ICI is sent to a core when a thread is queued on it, and the core is 
+  running a thread of lower priority, or (in tickless mode) the core may not
+  be ticking. 
+
+  If the core is idle, or a higher-priority thread is waiting, we reschedule 
+  at once. Else, we arm the quantum alarm, so that the queued threads get 
+  their turn.
+ */
 void ici_handler()
-{ /* noop for now... */
+{
+	CCB* ccb = &CURCORE;
+	TCB* current = ccb->current_thread;
+
+	if (current == &ccb->idle_thread) {
+		yield(SCHED_IDLE);
+		return;
+	}
+
+	/* This is just a hint, the scheduler will check again */
+	uint64_t mask = __atomic_load_n(&ccb->ready_mask, __ATOMIC_RELAXED);
+	if (mask && 63 - __builtin_clzll(mask) > sched_priority(current)) {
+		yield(SCHED_PREEMPT);
+		return;
+	}
+
+#if SCHED_TICKLESS
+	TimerDuration remaining = bios_cancel_timer();
+	TimerDuration quantum = current->its;
+	bios_set_timer((remaining > 0 && remaining < quantum) ? remaining : quantum);
+#endif
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Try to lock a scheduler spinlock without spinning. 
+  Return 1 on success and 0 on failure.
+*/
+static inline int sched_trylock(Mutex* lock)
+{
+	return ! __atomic_test_and_set(lock, __ATOMIC_ACQUIRE);
+}
+
+/*
+  Lock the scheduler of the core owning tcb, and return its CCB.
+
+  The owner of a READY thread may change by stealing, therefore
+  we must re-check after acquiring the lock.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
 */
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+static CCB* sched_lock_thread(TCB* tcb)
+{
+	while (1) {
+		CCB* ccb = &cctx[__atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE)];
+		Mutex_Lock(&ccb->sched_lock);
+		if (ccb->id == __atomic_load_n(&tcb->core, __ATOMIC_RELAXED))
+			return ccb;
+		Mutex_Unlock(&ccb->sched_lock);
+	}
+}
+
+/*
+  Possibly add TCB to the timer wheel of its core.
+
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void sched_register_timeout(CCB* ccb, TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
 		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		/* add to the timer wheel */
+		timer_wheel_insert(&ccb->timeouts, tcb);
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Apply to tcb any priority boost of its owner core that it has missed.
+  The idle thread is never queued, and stays at the lowest level.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static inline void sched_apply_boost(CCB* ccb, TCB* tcb)
 {
-	///// Implementation of MLFQ
-	///// must change rlist_push_back to handle multiple ques
-	///// rlist_push_back(&SCHED[TCB->priority])
-	int p= tcb->priority;
+	if (tcb->type != IDLE_THREAD && tcb->boost_epoch != ccb->boost_epoch) {
+		tcb->priority = PQ - 1;
+		tcb->allotment_used = 0;
+		tcb->boost_epoch = ccb->boost_epoch;
+	}
+}
+
+/*
+  Pop the head (or tail) of ready queue p.
+
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static inline TCB* sched_queue_pop(CCB* ccb, int p, int back)
+{
+	rlnode* q = &ccb->ready_queue[p];
+	TCB* tcb = (back ? rlist_pop_back(q) : rlist_pop_front(q))->tcb;
+	if (is_rlist_empty(q))
+		ccb->ready_mask &= ~(1ull << p);
+	ccb->ready_count--;
+	return tcb;
+}
+
+/*
+  Add TCB to the end of its priority queue, at the core that owns it.
+
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void sched_queue_push(CCB* ccb, TCB* tcb)
+{
+	sched_apply_boost(ccb, tcb);
+
+	int p = sched_priority(tcb);
 	if (p < 0) p = 0;
-	if(p >= PQ) p = PQ - 1;
+	if (p >= PQ) p = PQ - 1;
+
 	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[p], &tcb->sched_node);
+	rlist_push_back(&ccb->ready_queue[p], &tcb->sched_node);
+	ccb->ready_mask |= 1ull << p;
+	ccb->ready_count++;
+}
+
+/*
+  Add TCB to the ready queues of its owner core, and notify the cores 
+  that should know about it.
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void sched_queue_add(CCB* ccb, TCB* tcb)
+{
+	sched_queue_push(ccb, tcb);
+
+	/* 
+	  The thread is queued at the core it last ran on, which is the most likely
+	  to have a warm cache for it. If this core is running a thread of lower
+	  priority, preempt it.
+	 */
+	TCB* running = ccb->current_thread;
+	int idle = (running == NULL || running == &ccb->idle_thread); /* NULL before run_scheduler() */
+	int preempt = !idle && sched_priority(running) < sched_priority(tcb);
+
+#if SCHED_TICKLESS
+	/* 
+	  The owning core does not tick, if it is idle or had nothing else to run. 
+	  An ICI is never lost, even if the core is just about to halt. 
+	 */
+	if (idle || preempt || ccb->ready_count == 1)
+		cpu_ici(ccb->id);
+#else
+	/* If the owning core is idle, restart it in case it is halted. */
+	if (idle)
+		cpu_core_restart(ccb->id);
+	else if (preempt)
+		cpu_ici(ccb->id);
+#endif
+
+	/* Else, restart some halted core, which may steal the thread. */
+	if (!idle && !preempt)
+		cpu_core_restart_one();
 }
 
 /*
 	Adjust the state of a thread to make it READY.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH ccb->sched_lock HELD ***
  */
-static void sched_make_ready(TCB* tcb)
+static void sched_make_ready(CCB* ccb, TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timer wheel */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in the timer wheel, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
+		timer_wheel_remove(&ccb->timeouts, tcb);
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
 
@@ -305,79 +658,186 @@ static void sched_make_ready(TCB* tcb)
 
 	/* Possibly add to the scheduler queue */
 	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+		sched_queue_add(ccb, tcb);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Advance the timer wheel of a core, waking up the threads whose 
+  timeout has expired.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
 */
-static void sched_wakeup_expired_timeouts()
+static void sched_wakeup_expired_timeouts(CCB* ccb, TimerDuration now)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	/* Advance the timer wheel up to the current time and wake up each expired thread */
+	rlnode expired;
+	rlnode_init(&expired, NULL);
+	timer_wheel_advance(&ccb->timeouts, now, &expired);
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
-	}
+	while (!is_rlist_empty(&expired))
+		sched_make_ready(ccb, rlist_pop_front(&expired)->tcb);
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Steal a thread for core thief from some other core. 
+
+  We take the tail of the lowest-priority non-empty queue of the victim,
+  i.e., the thread least likely to run there soon. Cores whose lock is
+  contended are skipped.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Return NULL if no thread could be stolen.
+
+  *** MUST BE CALLED WITH thief->sched_lock HELD ***
 */
-static TCB* sched_queue_select(TCB* current)
+static TCB* sched_steal(CCB* thief)
 {
-	/* Get the head of the SCHED list */
-	//rlnode* sel = rlist_pop_front(&SCHED);
-////////////new new new new new new
-	rlnode* sel = NULL;
-	TCB* next_thread = NULL;
+	uint ncores = cpu_cores();
 
-	for(int i = PQ - 1; i >= 0; i--){
-		if(!is_rlist_empty(&SCHED[i])){
-			sel = rlist_pop_front(&SCHED[i]);
-			next_thread = sel->tcb;
-			break;
+	for (uint i = 1; i < ncores; i++) {
+		CCB* victim = &cctx[(thief->id + i) % ncores];
+
+		if (__atomic_load_n(&victim->ready_count, __ATOMIC_RELAXED) == 0)
+			continue;
+		if (!sched_trylock(&victim->sched_lock))
+			continue;
+
+		TCB* tcb = NULL;
+		if (victim->ready_mask) {
+			tcb = sched_queue_pop(victim, __builtin_ctzll(victim->ready_mask), 1);
+
+			/* Settle the priority of tcb, before it changes epochs */
+			sched_apply_boost(victim, tcb);
+			tcb->boost_epoch = thief->boost_epoch;
+			__atomic_store_n(&tcb->core, thief->id, __ATOMIC_RELEASE);
 		}
+
+		Mutex_Unlock(&victim->sched_lock);
+
+		if (tcb != NULL)
+			return tcb;
 	}
-/////////// new new new new new new 
+	return NULL;
+}
+
+/*
+  Remove the head of the highest-priority non-empty queue of the
+  core and return it. If the local queues are empty, and the current
+  thread cannot continue, try to steal a thread from another core.
+  As a last resort, return the current thread, if it is READY, or 
+  else the idle thread.
+
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static TCB* sched_queue_select(CCB* ccb, TCB* current)
+{
+	TCB* next_thread = NULL;
+
+	/* The highest non-empty level */
+	if (ccb->ready_mask)
+		next_thread = sched_queue_pop(ccb, 63 - __builtin_clzll(ccb->ready_mask), 0);
+
+	if (next_thread == NULL && current->state != READY)
+		next_thread = sched_steal(ccb);
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = (current->state == READY) ? current : &ccb->idle_thread;
 
 	next_thread->its = QUANTUM;
 
 	return next_thread;
 }
 
-/// new new new new new new
-int N = 0;
-void priority_boost()
+/*
+  Boost all threads of a core to the top priority level.
+
+  The lower queues are appended to the top queue, in order of priority.
+  The priority field of each thread is updated lazily, by 
+  sched_apply_boost().
+
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void priority_boost(CCB* ccb, TimerDuration now)
 {
-    rlnode* list;
-    rlnode* node;
+    rlnode* top = &ccb->ready_queue[PQ - 1];
+    uint64_t lower = ccb->ready_mask & ~(1ull << (PQ - 1));
 
-    for (int i = 1; i < PQ; i++) {   // move all lower queues upward
-        list = &SCHED[i];
-        while (!is_rlist_empty(list)) {
-            node = rlist_pop_front(list);
-            TCB* t = node->tcb;
-            if (t->priority > 0)
-                t->priority--;
-            rlist_push_back(&SCHED[t->priority], node);
-        }
+    while (lower) {
+        int p = 63 - __builtin_clzll(lower);
+        rlist_append(top, &ccb->ready_queue[p]);
+        lower &= ~(1ull << p);
     }
+    if (ccb->ready_mask)
+        ccb->ready_mask = 1ull << (PQ - 1);
 
-    N = 0;
+    ccb->boost_epoch++;
+    ccb->last_boost = now;
+}
+
+
+/*
+  Priority inheritance.
+
+  The lent levels of a thread are counted in @c tcb->lenders, under the
+  scheduler lock of its core, and @c tcb->inherited_priority is the highest
+  level with a lender. A queued thread whose level changes is moved to its
+  new queue through its own node, since a queued thread sits in the queue
+  of its level, unless its core was boosted meanwhile, in which case it sits
+  in the top queue, where it stays.
+ */
+static int sched_update_lenders(TCB* tcb, int from, int to, const int* lent, int sign)
+{
+	CCB* ccb = sched_lock_thread(tcb);
+	int queued = (tcb->state == READY && tcb->phase == CTX_CLEAN);
+	int boosted = (tcb->boost_epoch != ccb->boost_epoch);
+	int old = sched_priority(tcb);
+
+	if (from >= 0)
+		tcb->lenders[from]--;
+	if (to >= 0)
+		tcb->lenders[to]++;
+	if (lent)
+		for (int p = 0; p < PQ; p++)
+			tcb->lenders[p] += sign * lent[p];
+
+	int top = PQ - 1;
+	while (top >= 0 && tcb->lenders[top] == 0)
+		top--;
+	tcb->inherited_priority = top;
+
+	if (queued && !boosted && sched_priority(tcb) != old) {
+		rlnode* q = &ccb->ready_queue[old];
+		rlist_remove(&tcb->sched_node);
+		if (is_rlist_empty(q))
+			ccb->ready_mask &= ~(1ull << old);
+		ccb->ready_count--;
+		if (sched_priority(tcb) > old)
+			sched_queue_add(ccb, tcb);
+		else
+			sched_queue_push(ccb, tcb);
+	}
+
+	int prio = sched_priority(tcb);
+	Mutex_Unlock(&ccb->sched_lock);
+	return prio;
+}
+
+int sched_lend_priority(TCB* tcb, int from, int to)
+{
+	int preempt = preempt_off;
+	int prio = sched_update_lenders(tcb, from, to, NULL, 0);
+	if (preempt)
+		preempt_on;
+	return prio;
+}
 
+void sched_pass_priority(TCB* from, TCB* to, const int* lent)
+{
+	int preempt = preempt_off;
+	/* One core at a time, as we may not hold two scheduler locks */
+	sched_update_lenders(from, -1, -1, lent, -1);
+	sched_update_lenders(to, -1, -1, lent, 1);
+	if (preempt)
+		preempt_on;
 }
 
 
@@ -391,15 +851,15 @@ int wakeup(TCB* tcb)
 	/* Preemption off */
 	int oldpre = preempt_off;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	/* To touch tcb->state, we must get the spinlock of its core. */
+	CCB* ccb = sched_lock_thread(tcb);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
+		sched_make_ready(ccb, tcb);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&ccb->sched_lock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -418,22 +878,24 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 
 	int preempt = preempt_off;
-	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	CCB* ccb = &CURCORE;
+	TCB* tcb = ccb->current_thread;
+	assert(tcb->core == ccb->id);
+	Mutex_Lock(&ccb->sched_lock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
 
 	/* register the timeout (if any) for the sleeping thread */
 	if (state != EXITED)
-		sched_register_timeout(tcb, timeout);
+		sched_register_timeout(ccb, tcb, timeout);
 
 	/* Release mx */
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
 	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&ccb->sched_lock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -454,9 +916,10 @@ void yield(enum SCHED_CAUSE cause)
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	CCB* ccb = &CURCORE;
+	TCB* current = ccb->current_thread; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&ccb->sched_lock);
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
@@ -467,60 +930,40 @@ void yield(enum SCHED_CAUSE cause)
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
-	// new new new new new
-
-	switch(cause)
-        {
-            case SCHED_QUANTUM :
-                            if(current->priority>0)
-                            current->priority--;
-                            break;
-        
-            case SCHED_IO      : 
-                            if(current->priority < PQ-1)
-                            current->priority++;
-                            break;
-            case SCHED_MUTEX   :
-                             if(current->last_cause == SCHED_MUTEX && current->priority>0)
-                             current->priority--;
-                             break;
-            default:
-                break;
-
-    }
-
-    /* Wake up threads whose sleep timeout has expired */
-    sched_wakeup_expired_timeouts();
-
-    N++;
-    if(N==5000)    //enough for fibo(40) to run
-        priority_boost();
+	/* Catch up with any boost that we missed */
+	sched_apply_boost(ccb, current);
 
-
-	if (current->priority < 0){
-		current->priority = 0;
-	}
-
-	if (current->priority >= PQ){
-		current->priority = PQ - 1;
+	/* Charge the time-slice to the allotment of the current level, and demote if exhausted */
+	TimerDuration now = bios_clock();
+	if (current != &ccb->idle_thread) {
+		current->allotment_used += now - current->slice_start;
+		if (current->allotment_used >= PRIORITY_ALLOTMENT(current->priority) && current->priority > 0) {
+			current->priority--;
+			current->allotment_used = 0;
+		}
 	}
 
+	/* Wake up threads whose sleep timeout has expired */
+	sched_wakeup_expired_timeouts(ccb, now);
 
+	/* Periodically boost all threads, to avoid starvation */
+	if (now - ccb->last_boost >= PRIORITY_BOOST_PERIOD)
+		priority_boost(ccb, now);
 
     /* Get next */
-    TCB* next = sched_queue_select(current);
+    TCB* next = sched_queue_select(ccb, current);
     assert(next != NULL);
 
 
     /* Save the current TCB for the gain phase */
-    CURCORE.previous_thread = current;
+    ccb->previous_thread = current;
 
 
-    Mutex_Unlock(&sched_spinlock);
+    Mutex_Unlock(&ccb->sched_lock);
 
     /* Switch contexts */
     if (current != next) {
-        CURTHREAD = next;
+        ccb->current_thread = next;
         cpu_swap_context(&current->context, &next->context);
     }
 
@@ -546,23 +989,28 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	/* We may have been switched on at a different core than the one we left */
+	CCB* ccb = &CURCORE;
+	Mutex_Lock(&ccb->sched_lock);
 
-	TCB* current = CURTHREAD;
+	TCB* current = ccb->current_thread;
 
 	/* Mark current state */
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->slice_start = bios_clock();
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = ccb->previous_thread;
 	if (current != prev) {
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
 		case READY:
-			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+			if (prev->type != IDLE_THREAD) {
+				sched_queue_push(ccb, prev);
+				cpu_core_restart_one();
+			}
 			break;
 		case EXITED:
 			release_TCB(prev);
@@ -574,14 +1022,32 @@ void gain(int preempt)
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* We need the quantum alarm only if some other thread is waiting */
+	int ticking = !SCHED_TICKLESS || (current != &ccb->idle_thread && ccb->ready_count > 0);
+
+	/* Alarm time, when not ticking: the next timeout on this core */
+	TimerDuration alarm = current->rts;
+	if (!ticking) {
+		alarm = timer_wheel_next(&ccb->timeouts);
+		if (alarm != NO_TIMEOUT) {
+			TimerDuration now = bios_clock();
+			alarm = (alarm > now) ? alarm - now : (1 << TIMER_WHEEL_TICK_SHIFT);
+		}
+	}
+
+	Mutex_Unlock(&ccb->sched_lock);
+
+	/* 
+	  Set a 1-quantum alarm, or else an alarm for the next timeout, if any. 
+	  This must be done before preemption is restored, else an interrupt handler
+	  could set a more recent alarm, which we would overwrite.
+	 */
+	if (alarm != NO_TIMEOUT)
+		bios_set_timer(alarm);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
-
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
 }
 
 static void idle_thread()
@@ -601,14 +1067,30 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues of all cores
  */
 void initialize_scheduler()
 {
-	for(int i=0; i < PQ; i++){
-		rlnode_init(&SCHED[i], NULL);
+	lock_stats_name(&active_threads_spinlock, "active_threads");
+	for (uint c = 0; c < MAX_CORES; c++) {
+		CCB* ccb = &cctx[c];
+		ccb->id = c;
+		ccb->sched_lock = MUTEX_INIT;
+		if (c < cpu_cores())
+			lock_stats_name(&ccb->sched_lock, "sched_lock");
+		for (int i = 0; i < PQ; i++)
+			rlnode_init(&ccb->ready_queue[i], NULL);
+		ccb->ready_mask = 0;
+		ccb->ready_count = 0;
+		timer_wheel_init(&ccb->timeouts, bios_clock());
+		ccb->last_boost = bios_clock();
+		rlnode_init(&ccb->thread_pool, NULL);
+		ccb->thread_pool_size = 0;
+		ccb->thread_pool_hits = 0;
+		ccb->thread_pool_misses = 0;
+		ccb->thread_pool_overflows = 0;
+		ccb->boost_epoch = 0;
 	}
-	rlnode_init(&TIMEOUT_LIST, NULL);
 }
 
 void run_scheduler()
@@ -616,7 +1098,7 @@ void run_scheduler()
 	CCB* curcore = &CURCORE;
 
 	/* Initialize current CCB */
-	curcore->id = cpu_core_id;
+	assert(curcore->id == cpu_core_id);
 
 	curcore->current_thread = &curcore->idle_thread;
 
@@ -625,6 +1107,8 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.core = curcore->id;
+	curcore->idle_thread.inherited_priority = -1;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -645,4 +1129,10 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+
+	/* Return the thread pool to the system */
+	while (curcore->thread_pool_size > 0) {
+		free_thread(rlist_pop_front(&curcore->thread_pool)->tcb);
+		curcore->thread_pool_size--;
+	}
 }
@@ -89,9 +89,24 @@ enum SCHED_CAUSE {
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief Preempted in favor of a higher-priority thread */
 };
 
+/**
+  @brief Number of priority queues of the MLFQ scheduler.
+
+  Higher-numbered queues have higher priority. The value can be
+  overriden at compile time, up to 64 levels.
+ */
+#ifndef PQ
+#define PQ 3
+#endif
+
+#if PQ < 1 || PQ > 64
+#error "PQ must be between 1 and 64"
+#endif
+
 //struct  PTCB;    // Forward Declaration
 /**
   @brief The thread control block
@@ -105,8 +120,41 @@ typedef struct thread_control_block {
   PTCB* ptcb;     // Added -- Pointer to PTCB new new new
   int priority; // new new new new new new
 
+	uint core; /**< @brief The core whose scheduler owns this thread.
+
+	  A thread is queued at (and runs on) the core it is owned by. 
+	  The state of the thread is protected by the @c sched_lock of this core.
+	  Ownership only changes when an idle core steals a @c READY thread.
+	  */
+	uint boost_epoch; /**< @brief The boost epoch of the owner core, when @c priority was last updated.
+
+	  If the owner core has been boosted since, the thread's priority is 
+	  lazily raised to the top level.
+	  @see CCB
+	  */
+	int io_flags; /**< @brief The flags of the stream accessed by the current system call.
+	  @see stream_nonblocking
+	  */
+
+	int inherited_priority; /**< @brief The highest priority lent by threads waiting for a lock held by this thread, or -1.
+
+	  The thread is scheduled at the higher of @c priority and this level. 
+	  @see sched_lend_priority
+	  */
+	int lenders[PQ]; /**< @brief The number of waiters lending each priority level to this thread */
+	void* lock_waiter; /**< @brief The wait record of the thread while it is parked at a lock, else NULL.
+
+	  It is used to pass lent priority along a chain of lock owners.
+	  */
+	int held_mutexes; /**< @brief The number of mutexes locked by this thread.
+
+	  A thread that exits holding a mutex is never released, since the
+	  waiters at that mutex still look at its owner.
+	  */
+
 
 	cpu_context_t context; /**< @brief The thread context */
+	size_t stack_size; /**< @brief The size of the thread stack, which lies right below the TCB */
 	Thread_type type; /**< @brief The type of thread */
 	Thread_state state; /**< @brief The state of the thread */
 	Thread_phase phase; /**< @brief The phase of the thread */
@@ -119,6 +167,9 @@ typedef struct thread_control_block {
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
 
+	TimerDuration slice_start; /**< @brief The time the current time-slice started */
+	TimerDuration allotment_used; /**< @brief CPU time used at the current priority level */
+
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
@@ -138,18 +189,119 @@ typedef struct thread_control_block {
 /** @brief Thread stack size.
 
   The default thread stack size in TinyOS is 128 kbytes.
+  Threads may be given a different stack size (at least @c THREAD_STACK_MIN),
+  see @c CreateThreadStack() and @c ExecStack().
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief Thread pool high-water mark.
+
+  When a thread is released, its TCB and stack are kept in the free pool
+  of the core, unless the pool already holds this many blocks.
+ */
+#ifndef THREAD_POOL_HIGH_WATER
+#define THREAD_POOL_HIGH_WATER 16
+#endif
+
+/************************
+ *
+ *      Timeouts
+ *
+ ************************/
+
+/** @brief Bits of the slot index of each level of a timer wheel */
+#define TIMER_WHEEL_BITS 6
+
+/** @brief Number of slots in each level of a timer wheel */
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+
+/** @brief Number of levels of a timer wheel */
+#define TIMER_WHEEL_LEVELS 4
+
+/** @brief The length of a timer wheel tick is @c 2^TIMER_WHEEL_TICK_SHIFT usec (about 1 msec) */
+#define TIMER_WHEEL_TICK_SHIFT 10
+
+/** @brief A hierarchical timing wheel.
+
+  This structure holds the threads sleeping with a timeout, keyed on
+  their @c wakeup_time. Time is divided into ticks; the wheel has 
+  @c TIMER_WHEEL_LEVELS levels of @c TIMER_WHEEL_SIZE slots each, where 
+  a slot of level @c l spans @c TIMER_WHEEL_SIZE^l ticks. A thread is 
+  queued (by its @c sched_node) into the slot of the lowest level that 
+  covers its wakeup tick. When time advances into a slot of a higher level,
+  its threads are cascaded to lower levels.
+
+  Insertion and removal are O(1). Advancing the wheel costs O(1) per expired
+  thread, plus an amortized O(1) per cascaded thread and per occupied tick.
+
+  Timeouts are rounded up to the next tick, so that a thread is never woken
+  before its @c wakeup_time. Timeouts beyond the range of the wheel (about 4.7 
+  hours) are parked in the last slot of the top level and re-cascaded until 
+  they expire.
+ */
+typedef struct timer_wheel {
+	TimerDuration tick; /**< @brief The next tick to be processed */
+	uint count; /**< @brief The number of threads in the wheel */
+	uint64_t occupied[TIMER_WHEEL_LEVELS]; /**< @brief Bitmaps of possibly non-empty slots */
+	rlnode slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE]; /**< @brief The slot lists */
+} timer_wheel;
+
+/** @brief Initialize an empty timer wheel, whose time starts at @c now. */
+void timer_wheel_init(timer_wheel* tw, TimerDuration now);
+
+/** @brief Add a thread to the wheel, according to its @c wakeup_time. */
+void timer_wheel_insert(timer_wheel* tw, TCB* tcb);
+
+/** @brief Remove a thread that is in the wheel. */
+void timer_wheel_remove(timer_wheel* tw, TCB* tcb);
+
+/** @brief Advance the wheel to time @c now.
+
+  Every thread whose @c wakeup_time is not after @c now is removed
+  from the wheel and appended to list @c expired. 
+  The @c wakeup_time of the expired threads is set to @c NO_TIMEOUT.
+ */
+void timer_wheel_advance(timer_wheel* tw, TimerDuration now, rlnode* expired);
+
+/** @brief Return a time by which the wheel should next be advanced.
+
+  The returned time is not later than the earliest @c wakeup_time in the wheel,
+  rounded up to a tick. It may be earlier, when some threads must be cascaded.
+  If the wheel is empty, @c NO_TIMEOUT is returned.
+ */
+TimerDuration timer_wheel_next(timer_wheel* tw);
+
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/**
+  @brief Tickless scheduling.
+
+  When non-zero, a core does not arm its quantum alarm unless there are other
+  threads in its ready queues; it only arms its timer for the earliest timeout
+  of its sleeping threads, if any. In particular, an idle core stays halted 
+  until there is work for it. 
+
+  Cores that enqueue a thread at a core which may not be ticking, notify it 
+  by an inter-core interrupt (ICI).
+
+  Build with @c -DSCHED_TICKLESS=0 to restore the periodic quantum alarm.
+ */
+#ifndef SCHED_TICKLESS
+#define SCHED_TICKLESS 1
+#endif
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a set of MLFQ ready queues and a list of threads sleeping
+  with a timeout. These, as well as the state of every thread owned by the core,
+  are protected by the core's @c sched_lock. 
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -158,6 +310,38 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Mutex sched_lock; /**< @brief Spinlock for the scheduler data of this core */
+	rlnode ready_queue[PQ]; /**< @brief The MLFQ ready queues of this core */
+	uint64_t ready_mask; /**< @brief Bit @c p is set iff @c ready_queue[p] is non-empty */
+	uint ready_count; /**< @brief Number of threads in @c ready_queue */
+	timer_wheel timeouts; /**< @brief The threads of this core sleeping with a timeout */
+
+	TimerDuration last_boost; /**< @brief The time of the last priority boost */
+
+	rlnode thread_pool; /**< @brief Free TCB+stack blocks, for reuse by @c spawn_thread().
+
+	  The pool is only accessed by its own core, with preemption off, therefore
+	  it needs no lock.
+	  */
+	uint thread_pool_size; /**< @brief Number of blocks in @c thread_pool */
+	unsigned long thread_pool_hits; /**< @brief Threads spawned with a block from the pool */
+	unsigned long thread_pool_misses; /**< @brief Threads spawned with a newly allocated block */
+	unsigned long thread_pool_overflows; /**< @brief Blocks freed because the pool was full */
+	uint boost_epoch; /**< @brief Number of priority boosts of this core.
+
+	  A boost moves all queued threads to the top level in O(PQ) list splices. The 
+	  priority of each thread owned by this core is fixed lazily, when it is next 
+	  examined, by comparing its @c boost_epoch to this value.
+	  */
+
+	uint rcu_nesting; /**< @brief Depth of nested RCU read sections on this core */
+	int rcu_preempt; /**< @brief Preemption status before the outermost RCU read section */
+	unsigned long rcu_seq; /**< @brief Odd while the core is in an RCU read section.
+
+	  It is incremented on entry to and exit from each outermost read section, so
+	  that @c rcu_synchronize can tell when a section it saw has ended.
+	  */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -203,9 +387,11 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The size of the thread stack, rounded up to a page. If 0,
+                @c THREAD_STACK_SIZE is used. Else, it must be at least @c THREAD_STACK_MIN.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb,PTCB* ptcb, void (*func)());
+TCB* spawn_thread(PCB* pcb,PTCB* ptcb, void (*func)(), size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
@@ -251,6 +437,46 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+  @brief The level at which a thread is scheduled, including any lent priority.
+ */
+static inline int sched_priority(TCB* tcb)
+{
+	return (tcb->inherited_priority > tcb->priority) ? tcb->inherited_priority : tcb->priority;
+}
+
+/**
+  @brief Change the priority lent to a thread by a waiter of a lock it holds.
+
+  Each thread counts the waiters lending it each priority level, and it is
+  scheduled at least at the highest of these levels. This call moves one
+  waiter from level @c from to level @c to, where -1 stands for no level.
+  If @c tcb is queued, it is requeued at its core, at its new level.
+
+  The caller must make sure that @c tcb is alive, normally by holding the
+  guard of the lock, which the owner needs in order to hand the lock over.
+  This must be called in the non-preemptive domain.
+  @param tcb the thread holding the lock
+  @param from the level lent so far, or -1
+  @param to the level lent from now on, or -1
+  @returns the level at which @c tcb is now scheduled
+ */
+int sched_lend_priority(TCB* tcb, int from, int to);
+
+/**
+  @brief Pass the priority lent through a lock to the next owner of the lock.
+
+  When the lock is handed over, the waiters that stay queued lend their
+  priority to the new owner instead. @c lent[p] is the number of these 
+  waiters that lend level @c p.
+
+  This must be called in the non-preemptive domain, under the guard of the lock.
+  @param from the thread handing the lock over
+  @param to the thread the lock is handed to
+  @param lent the number of waiters lending each level
+ */
+void sched_pass_priority(TCB* from, TCB* to, const int* lent);
+
 /**
   @brief Give up the CPU.
 
@@ -276,15 +502,34 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
-void priority_boost();
-
 /**
   @brief Quantum (in microseconds) 
 
   This is the default quantum for each thread, in microseconds.
   */
 #define QUANTUM (10000L)
-#define PQ 3 // NEW NEW NEW 
+
+/**
+  @brief Priority boost period (in microseconds).
+
+  Every core raises all its threads to the top priority level at least this
+  often, as measured by @c bios_clock(). This bounds the time that a thread 
+  can starve, independently of the number of cores.
+ */
+#ifndef PRIORITY_BOOST_PERIOD
+#define PRIORITY_BOOST_PERIOD (1000000L)
+#endif
+
+/**
+  @brief Time allotment (in microseconds) of priority level @c p.
+
+  A thread is demoted to the next lower level when it has used 
+  this much CPU time at level @c p, whether in one or many time-slices. 
+  Lower levels get longer allotments.
+ */
+#ifndef PRIORITY_ALLOTMENT
+#define PRIORITY_ALLOTMENT(p) (QUANTUM * (PQ - (p)))
+#endif
 
 /** @} */
 
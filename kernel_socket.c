@@ -10,6 +10,15 @@
 // Port map - each port maps to a listener socket
 socket_cb* PORT_MAP[MAX_PORT+1] = {NULL};
 
+// The port map lock. It protects the updates to the port map, the state 
+// of all sockets and the connection requests. The data of peer sockets is
+// protected by the locks of their pipes.
+//
+// The port map is also read without the lock, in an RCU read section, so
+// that connections to ports without a listener fail without waiting for
+// the lock. Such readers only test the entries, and never dereference them.
+static ksem_t port_lock = KSEM_INIT;
+
 // Dummy functions for unused file_ops slots
 void* do_nothing_pt(uint minor){
     return NULL;
@@ -19,49 +28,59 @@ int do_nothing(void* this, char* buf, unsigned int size){
     return -1;
 }
 
+// Pin the read (or write) pipe of a connected socket, or return NULL.
+// ShutDown and close detach the pipes under the port lock, so the pipe
+// stays alive until it is unpinned.
+static pipe_cb* socket_pin_pipe(socket_cb* socketcb, int write)
+{
+	pipe_cb* pipecb = NULL;
+
+	ksem_lock(&port_lock);
+	if(socketcb->type==SOCKET_PEER)
+		pipecb = write ? socketcb->peer_s.write_pipe : socketcb->peer_s.read_pipe;
+	if(pipecb != NULL)
+		pipe_pin(pipecb);
+	ksem_unlock(&port_lock);
+	return pipecb;
+}
+
 // Read data from socket
 int socket_read(void* socket_cb_t, char* buf, unsigned int n){
 
 	socket_cb* socketcb = (socket_cb*)socket_cb_t;
-	if(socketcb->type!=SOCKET_PEER) return -1;
-	
-	if(socketcb->peer_s.read_pipe!=NULL){
-		int read_num = pipe_read(socketcb->peer_s.read_pipe, buf, n);
-		return read_num;
-	}else
-	{
-		return -1;
-	}
-	
+	pipe_cb* pipecb = socket_pin_pipe(socketcb, 0);
+	if(pipecb == NULL) return -1;
+
+	int read_num = pipe_read(pipecb, buf, n);
+	pipe_unpin(pipecb);
+	return read_num;
 }
 
 // Write data to socket
 int socket_write(void* socket_cb_t, const char *buf, unsigned int n){
 	
 	socket_cb* socketcb = (socket_cb*)socket_cb_t;
-	if(socketcb->type!=SOCKET_PEER) return -1;
-	if(socketcb->peer_s.write_pipe!=NULL){
-		int write_num = pipe_write(socketcb->peer_s.write_pipe, buf, n);
-		return write_num;
-	}else
-	{
-		return -1;
-	}
-	
+	pipe_cb* pipecb = socket_pin_pipe(socketcb, 1);
+	if(pipecb == NULL) return -1;
+
+	int write_num = pipe_write(pipecb, buf, n);
+	pipe_unpin(pipecb);
+	return write_num;
 }
 
 // Close socket
-int socket_close(void* socket_cb_t){
+static int socket_close_locked(void* socket_cb_t){
 
 	socket_cb* socketcb = (socket_cb*)socket_cb_t;
 
 	if(socketcb->refcount==1){	 // Waiting in accept/connect
 		socketcb->refcount--;
 		if(socketcb->type == SOCKET_LISTENER){ 
-			PORT_MAP[socketcb->port] = NULL;
+			rcu_assign_pointer(PORT_MAP[socketcb->port], NULL);
 				while(!is_rlist_empty(&socketcb->listener_s.queue))
 					rlist_pop_front(&socketcb->listener_s.queue);
-				kernel_broadcast(&socketcb->listener_s.req_available);	
+				Cond_Broadcast(&socketcb->listener_s.req_available);	
+				poll_wq_destroy(&socketcb->listener_s.poll, EPOLLHUP);
 				return 0;
 		}
 		else{ 					
@@ -82,7 +101,8 @@ int socket_close(void* socket_cb_t){
 				return 0;
 			}
 			else if(socketcb->type==SOCKET_LISTENER){
-				PORT_MAP[socketcb->port] = NULL;
+				rcu_assign_pointer(PORT_MAP[socketcb->port], NULL);
+				poll_wq_destroy(&socketcb->listener_s.poll, EPOLLHUP);
 				free(socketcb);
 				return 0;
 			}
@@ -95,12 +115,46 @@ int socket_close(void* socket_cb_t){
 
 }
 
+int socket_close(void* socket_cb_t)
+{
+	ksem_lock(&port_lock);
+	int ret = socket_close_locked(socket_cb_t);
+	ksem_unlock(&port_lock);
+	return ret;
+}
+
+// Poll socket: a listener is ready when requests are queued, a peer 
+// combines the two ends of its pipes
+int socket_poll(void* socket_cb_t, poll_table* pt)
+{
+	socket_cb* socketcb = (socket_cb*)socket_cb_t;
+	int events = -1;
+
+	ksem_lock(&port_lock);
+	if(socketcb->type==SOCKET_LISTENER){
+		poll_wait(&socketcb->listener_s.poll, pt);
+		events = is_rlist_empty(&socketcb->listener_s.queue) ? 0 : EPOLLIN;
+	}
+	else if(socketcb->type==SOCKET_PEER){
+		events = 0;
+		if(socketcb->peer_s.read_pipe != NULL)
+			events |= pipe_reader_poll(socketcb->peer_s.read_pipe, pt);
+		if(socketcb->peer_s.write_pipe != NULL)
+			events |= pipe_writer_poll(socketcb->peer_s.write_pipe, pt);
+		if(socketcb->peer_s.read_pipe == NULL && socketcb->peer_s.write_pipe == NULL)
+			events = EPOLLHUP;
+	}
+	ksem_unlock(&port_lock);
+	return events;
+}
+
 // File operations for sockets
 file_ops socket_file_ops = {
   .Open = do_nothing_pt,
   .Read = socket_read,
   .Write = socket_write,
-  .Close = socket_close
+  .Close = socket_close,
+  .Poll = socket_poll
 };
 
 // Create and initialize socket control block
@@ -116,19 +170,18 @@ socket_cb* initialize_socket_cb(){
 	return socketcb;
 }
 
-// Create socket
-Fid_t sys_Socket(port_t port)
+// Create a socket on a new file id, or return NULL if none is left
+static socket_cb* socket_open(port_t port, Fid_t* fid)
 {
-	// Validate port
-	if(port<0 || port>MAX_PORT) return NOFILE;
-
-	Fid_t fid;
 	FCB* fcb;
 
 	socket_cb* socketcb = initialize_socket_cb();
 
 	// Reserve FCB
-	if(!FCB_reserve(1, &fid, &fcb)) return NOFILE;
+	if(!FCB_reserve(1, fid, &fcb)) {
+		free(socketcb);
+		return NULL;
+	}
 
 	socketcb->fcb = fcb;
 
@@ -137,11 +190,22 @@ Fid_t sys_Socket(port_t port)
 	socketcb->fcb->streamobj = socketcb;
 
 	socketcb->port = port;
+	return socketcb;
+}
+
+// Create socket
+Fid_t sys_Socket(port_t port)
+{
+	// Validate port
+	if(port<0 || port>MAX_PORT) return NOFILE;
+
+	Fid_t fid;
+	if(socket_open(port, &fid)==NULL) return NOFILE;
 	return fid;
 }
 
 // Set socket to listening state
-int sys_Listen(Fid_t sock)
+static int listen_locked(Fid_t sock)
 {
 	// Validate fid
 	if(sock<0 || sock>15) return -1;
@@ -158,17 +222,27 @@ int sys_Listen(Fid_t sock)
 		socketcb->port == NOPORT ||
 			PORT_MAP[socketcb->port]!=NULL) return -1;
 	
-	// Register in port map
-	PORT_MAP[socketcb->port] = socketcb;
 	socketcb->type = SOCKET_LISTENER;
 
 	// Initialize listener
 	socketcb->listener_s.req_available = COND_INIT;
 	rlnode_init(&socketcb->listener_s.queue, NULL);
+	poll_wq_init(&socketcb->listener_s.poll);
+
+	// Register in port map
+	rcu_assign_pointer(PORT_MAP[socketcb->port], socketcb);
 
 	return 0;
 }
 
+int sys_Listen(Fid_t sock)
+{
+	ksem_lock(&port_lock);
+	int ret = listen_locked(sock);
+	ksem_unlock(&port_lock);
+	return ret;
+}
+
 // Connect two sockets with pipes
 void connect_pipes(socket_cb* request_socket, socket_cb* new_socket){
 
@@ -199,7 +273,7 @@ void connect_pipes(socket_cb* request_socket, socket_cb* new_socket){
 }
 
 // Accept new connection
-Fid_t sys_Accept(Fid_t lsock)
+static Fid_t accept_locked(Fid_t lsock)
 {
 	// Validate
 	if(lsock<0 || lsock > 15) {
@@ -218,11 +292,15 @@ Fid_t sys_Accept(Fid_t lsock)
 		return NOFILE;
   }
 	
+	// A non-blocking listener does not wait
+	if(is_rlist_empty(&socketcb->listener_s.queue) && (fcb->flags & FD_NONBLOCK))
+		return WOULDBLOCK;
+
 	socketcb->refcount++;  
 
 	// Wait until request arrives
 	while(is_rlist_empty(&socketcb->listener_s.queue) && socketcb->refcount==1){
-		kernel_wait(&socketcb->listener_s.req_available, SCHED_USER);
+		ksem_wait(&port_lock, &socketcb->listener_s.req_available, SCHED_USER);
 	}
 
 	// Check if closed while waiting
@@ -237,25 +315,31 @@ Fid_t sys_Accept(Fid_t lsock)
 	socket_cb* request_socket = request->peer;
 	
 	// Create new socket
-	Fid_t new_fid = sys_Socket(socketcb->port);
-	if(new_fid==NOFILE){
-		kernel_signal(&request->connected_cv);
+	Fid_t new_fid;
+	socket_cb* new_socketcb = socket_open(socketcb->port, &new_fid);
+	if(new_socketcb==NULL){
+		Cond_Signal(&request->connected_cv);
 		return NOFILE;
 	}
 
-	FCB* new_fcb = get_fcb(new_fid);
-	socket_cb* new_socketcb = (socket_cb*)new_fcb->streamobj;
-
 	// Connect the two sockets
 	connect_pipes(request_socket, new_socketcb);
 
 	// Notify client we connected
 	request->admitted = 1;
-	kernel_signal(&request->connected_cv);
+	Cond_Signal(&request->connected_cv);
 	socketcb->refcount--;
 	return new_fid;
 }
 
+Fid_t sys_Accept(Fid_t lsock)
+{
+	ksem_lock(&port_lock);
+	Fid_t ret = accept_locked(lsock);
+	ksem_unlock(&port_lock);
+	return ret;
+}
+
 // Create connection request
 connection_request* initialize_request(socket_cb* socketcb){
 
@@ -268,7 +352,7 @@ connection_request* initialize_request(socket_cb* socketcb){
 }
 
 // Connect to listener socket
-int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+static int connect_locked(Fid_t sock, port_t port, timeout_t timeout)
 {
 	// Validate parameters
 	if(sock<0 || sock > 15 ||
@@ -297,10 +381,11 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	rlist_push_back(&lsocketcb->listener_s.queue, &request->queue_node);
 
 	// Notify listener
-	kernel_signal(&lsocketcb->listener_s.req_available);
+	Cond_Signal(&lsocketcb->listener_s.req_available);
+	poll_notify(&lsocketcb->listener_s.poll, EPOLLIN);
 
 	// Wait for admission with timeout
-	kernel_timedwait(&request->connected_cv, SCHED_USER, timeout);
+	ksem_timedwait(&port_lock, &request->connected_cv, SCHED_USER, timeout);
 
 	int retVal = request->admitted;
 	free(request);
@@ -316,8 +401,24 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
    return 0;
 }
 
+int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+{
+	if(port > MAX_PORT || port <= 0) return -1;
+
+	// Fail fast if nobody listens on the port
+	rcu_read_lock();
+	int listening = (rcu_dereference(PORT_MAP[port]) != NULL);
+	rcu_read_unlock();
+	if(! listening) return -1;
+
+	ksem_lock(&port_lock);
+	int ret = connect_locked(sock, port, timeout);
+	ksem_unlock(&port_lock);
+	return ret;
+}
+
 // Close socket end
-int sys_ShutDown(Fid_t sock, shutdown_mode how)
+static int shutdown_locked(Fid_t sock, shutdown_mode how)
 {
 	// Validate
 	if(sock<0 || sock>15) return -1;
@@ -365,4 +466,37 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 	}
 return 0;
 
-}
\ No newline at end of file
+}
+
+int sys_ShutDown(Fid_t sock, shutdown_mode how)
+{
+	ksem_lock(&port_lock);
+	int ret = shutdown_locked(sock, how);
+	ksem_unlock(&port_lock);
+	return ret;
+}
+// Capacity of the incoming direction of a connected socket
+int socket_capacity(FCB* fcb, int capacity)
+{
+	if(fcb->streamfunc != &socket_file_ops) return -1;
+
+	socket_cb* socketcb = (socket_cb*)fcb->streamobj;
+	int ret = -1;
+
+	// The read pipe stays alive while it is attached to the socket
+	ksem_lock(&port_lock);
+	if(socketcb->type == SOCKET_PEER && socketcb->peer_s.read_pipe != NULL)
+		ret = pipe_capacity(socketcb->peer_s.read_pipe, capacity);
+	ksem_unlock(&port_lock);
+
+	return ret;
+}
+
+
+// The pipe that a connected socket reads from (or writes to), pinned, or NULL.
+// The caller unpins it.
+pipe_cb* socket_pipe(FCB* fcb, int write)
+{
+	if(fcb->streamfunc != &socket_file_ops) return NULL;
+	return socket_pin_pipe((socket_cb*)fcb->streamobj, write);
+}
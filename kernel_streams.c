@@ -11,10 +11,35 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* 
+  Released FCBs are reused only after a grace period. The ones in FCB_retired
+  wait for the grace period FCB_gp, and the ones in FCB_pending, released
+  after it started, for the next one.
+*/
+static rlnode FCB_retired, FCB_pending;
+static rcu_gp FCB_gp;
+
+/* 
+  The file table lock. It protects the FCB free list and the updates to the
+  file id tables of the processes. It is a leaf lock: the stream operations 
+  are called without it.
+
+  Lookups in the file id tables take no lock. They run in an RCU read 
+  section, and take a reference to the FCB only if its reference count is 
+  not zero. The reference counts are atomic, and a released FCB returns to
+  the free list only after a grace period, so that a reader never sees an
+  FCB being reused. Nobody waits for the grace period: the FCB is reclaimed
+  by a later call that finds it over.
+*/
+static ksem_t files_lock = KSEM_INIT;
+
 
 void initialize_files()
 {
+  lock_stats_name(&files_lock, "files_lock");
   rlnode_init(&FCB_freelist,NULL);
+  rlnode_init(&FCB_retired,NULL);
+  rlnode_init(&FCB_pending,NULL);
   for(int i=0;i<MAX_FILES;i++) {
 
     FT[i].refcount = 0;
@@ -24,11 +49,33 @@ void initialize_files()
 }
 
 
+/* Move the retired FCBs to the free list, if their grace period is over */
+static void reclaim_FCBs()
+{
+  if(! is_rlist_empty(& FCB_retired) && rcu_gp_done(& FCB_gp))
+    rlist_append(& FCB_freelist, & FCB_retired);
+  if(is_rlist_empty(& FCB_retired) && ! is_rlist_empty(& FCB_pending)) {
+    rlist_append(& FCB_retired, & FCB_pending);
+    rcu_gp_start(& FCB_gp);
+  }
+}
+
 FCB* acquire_FCB()
 {
+  reclaim_FCBs();
+
+  /* Only when the file table is exhausted do we wait for a grace period */
+  if(is_rlist_empty(& FCB_freelist) && ! is_rlist_empty(& FCB_retired)) {
+    rcu_synchronize();
+    rlist_append(& FCB_freelist, & FCB_retired);
+    rlist_append(& FCB_freelist, & FCB_pending);
+  }
+
   if(! is_rlist_empty(& FCB_freelist)) {
     FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
+    fcb->flags = 0;
+    poll_wq_init(&fcb->watchers);
     return fcb;
   }
   else
@@ -40,20 +87,42 @@ void release_FCB(FCB* fcb)
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
 }
 
+/* Release an FCB that readers may still see */
+static void retire_FCB(FCB* fcb)
+{
+  rlist_push_back(& FCB_pending, & fcb->freelist_node);
+  reclaim_FCBs();
+}
+
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
+}
+
+int FCB_tryref(FCB* fcb)
+{
+  uint rc = __atomic_load_n(&fcb->refcount, __ATOMIC_RELAXED);
+  while(rc > 0)
+    if(__atomic_compare_exchange_n(&fcb->refcount, &rc, rc+1, 1, 
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 1;
+  return 0;
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  int last = (__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0);
+
+  if(last) {
+    /* Nobody else can take a reference now */
+    poll_wq_destroy(&fcb->watchers, EPOLLHUP);
     int retval = fcb->streamfunc->Close(fcb->streamobj);
-    release_FCB(fcb);
+    ksem_lock(&files_lock);
+    retire_FCB(fcb);
+    ksem_unlock(&files_lock);
     return retval;
   }
   else
@@ -62,7 +131,7 @@ int FCB_decref(FCB* fcb)
 
 
 
-int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
+static int FCB_reserve_locked(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
     size_t f=0;
@@ -90,22 +159,32 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     }
     /* Found all */
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
+	fcb[i]->refcount = 1;
+	rcu_assign_pointer(cur->FIDT[fid[i]], fcb[i]);
     }
     return 1;
 }
 
+int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
+{
+    ksem_lock(&files_lock);
+    int ret = FCB_reserve_locked(num, fid, fcb);
+    ksem_unlock(&files_lock);
+    return ret;
+}
+
 
 
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    ksem_lock(&files_lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
-	release_FCB(fcb[i]);
+	rcu_assign_pointer(cur->FIDT[fid[i]], NULL);
+	retire_FCB(fcb[i]);
     }
+    ksem_unlock(&files_lock);
 }
 
 
@@ -128,6 +207,18 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  rcu_read_lock();
+  FCB* fcb = rcu_dereference(CURPROC->FIDT[fid]);
+  if(fcb && ! FCB_tryref(fcb)) fcb = NULL;
+  rcu_read_unlock();
+  return fcb;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
@@ -135,27 +226,24 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream. The reference makes sure that the 
+     stream will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
-    if(devread)
+    if(devread) {
+      int io = stream_begin_io(fcb);
       retcode = devread(sobj, buf, size);
+      stream_end_io(io);
+    }
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
   
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
-
   return retcode;
 }
 
@@ -167,21 +255,20 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream. The reference makes sure that the 
+     stream will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
-    if(devwrite)
+    if(devwrite) {
+      int io = stream_begin_io(fcb);
       retcode = devwrite(sobj, buf, size);
+      stream_end_io(io);
+    }
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
@@ -197,10 +284,15 @@ int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
-  FCB* fcb = get_fcb(fd);
+  FCB* fcb = NULL;
+  if(retcode==0) {
+    ksem_lock(&files_lock);
+    fcb = CURPROC->FIDT[fd];
+    rcu_assign_pointer(CURPROC->FIDT[fd], NULL);
+    ksem_unlock(&files_lock);
+  }
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
     retcode = FCB_decref(fcb);    
   }
 
@@ -221,19 +313,59 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
+  ksem_lock(&files_lock);
   FCB* old = get_fcb(oldfd);
   FCB* new = get_fcb(newfd);
 
   if(old==NULL) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    rcu_assign_pointer(CURPROC->FIDT[newfd], old);
+  }
+  else
+    new = NULL;
+  ksem_unlock(&files_lock);
+
+  /* Close the replaced stream, without the lock */
+  if(new)
+    FCB_decref(new);
+
+  return retcode;
+}
+
+
+/*
+  Get or set the flags of file descriptor fd.
+
+  This call returns the flags for FCNTL_GETFL, 0 on success for FCNTL_SETFL, 
+  and -1 on failure.
+  Possible reasons for failure:
+  - The file descriptor is invalid.
+  - The command is unknown, or the flags contain unknown bits.
+ */
+int sys_Fcntl(Fid_t fd, fcntl_cmd cmd, int flags)
+{
+  FCB* fcb = get_fcb_ref(fd);
+  if(fcb == NULL)
+    return -1;
+
+  int retcode = -1;
+  switch(cmd) {
+  case FCNTL_GETFL:
+    retcode = __atomic_load_n(&fcb->flags, __ATOMIC_RELAXED);
+    break;
+  case FCNTL_SETFL:
+    if((flags & ~FD_NONBLOCK) == 0) {
+      __atomic_store_n(&fcb->flags, flags, __ATOMIC_RELAXED);
+      retcode = 0;
+    }
+    break;
   }
 
+  FCB_decref(fcb);
   return retcode;
 }
 
@@ -3,6 +3,7 @@
 
 #include "tinyos.h"
 #include "kernel_dev.h"
+#include "kernel_sched.h"
 
 /**
 	@file kernel_streams.h
@@ -43,11 +44,54 @@ typedef struct file_control_block
   uint refcount;  			/**< @brief Reference counter. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
+  int flags;				/**< @brief Stream flags, see @c Fcntl */
+  poll_wq watchers;		/**< @brief Polling instances, detached when the stream is closed */
   rlnode freelist_node;		/**< @brief Intrusive list node */
 } FCB;
 
 
 
+/**
+  @brief Check if the stream accessed by the current system call is non-blocking.
+
+  Stream methods do not see the FCB, so the system calls that may block 
+  on a stream copy its flags to the current thread for the duration of 
+  the call. A method that would block returns @c WOULDBLOCK instead, if 
+  this is true.
+ */
+static inline int stream_nonblocking()
+{
+  return cur_thread()->io_flags & FD_NONBLOCK;
+}
+
+/**
+  @brief Save the I/O flags of the current thread and set them to @c flags.
+  @returns the saved flags, to be restored by @c stream_end_io.
+ */
+static inline int stream_begin_io_flags(int flags)
+{
+  TCB* self = cur_thread();
+  int saved = self->io_flags;
+  self->io_flags = flags;
+  return saved;
+}
+
+/**
+  @brief Save the I/O flags of the current thread and set those of @c fcb.
+  @returns the saved flags, to be restored by @c stream_end_io.
+ */
+static inline int stream_begin_io(FCB* fcb)
+{
+  return stream_begin_io_flags(fcb->flags);
+}
+
+/** @brief Restore the I/O flags of the current thread. */
+static inline void stream_end_io(int saved)
+{
+  cur_thread()->io_flags = saved;
+}
+
+
 /** 
   @brief Initialization for files and streams.
 
@@ -64,11 +108,20 @@ void initialize_files();
 void FCB_incref(FCB* fcb);
 
 
+/**
+	@brief Increase the reference count of an fcb, unless it is being released.
+
+	@param fcb the fcb whose reference count will be increased
+	@returns 1 if a reference was taken, 0 if the reference count was 0
+*/
+int FCB_tryref(FCB* fcb);
+
+
 /**
 	@brief Decrease the reference count of the fcb.
 
-	If the reference count drops to 0, release the FCB, calling the 
-	Close method and returning its return value.
+	If the reference count drops to 0, release the FCB, detaching its
+	watchers and calling the Close method, and returning its return value.
 	If the reference count is still >0, return 0. 
 
 	@param fcb  the fcb whose reference count is decreased
@@ -122,12 +175,28 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 	This routine will return NULL if the fid is not legal.
 
+	The FCB may be closed by another thread of the process at any time;
+	the caller must either use @ref get_fcb_ref, or hold a lock
+	that the `Close()` operation of the stream also takes.
+
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB, and increase its reference count.
+
+	This is like @ref get_fcb, but the lookup and the increment happen
+	atomically, so the FCB cannot be closed until the caller calls 
+	@ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
 /** @} */
 
 #endif
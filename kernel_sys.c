@@ -12,13 +12,14 @@
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
-
+/*
+	System calls do not lock the kernel as a whole; each subsystem
+	takes its own lock (see kernel_cc.h).
+ */
+#define PRE_CALL
 
 
-#define POST_CALL \
-kernel_unlock();\
+#define POST_CALL
 
 
 /* with return */
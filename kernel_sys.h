@@ -6,11 +6,13 @@
 
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(ExecStack, int, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
@@ -22,13 +24,24 @@ SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(Fcntl, int, (Fid_t fd, fcntl_cmd cmd, int flags), (fd, cmd, flags))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PipeCapacity, int, (Fid_t fid, int capacity), (fid, capacity))\
+SYSCALL(Splice, int, (Fid_t fd_in, Fid_t fd_out, unsigned int len), (fd_in, fd_out, len))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(EpollCreate, Fid_t, (), ())\
+SYSCALL(EpollCtl, int, (Fid_t epfd, epoll_op op, Fid_t fd, int events), (epfd, op, fd, events))\
+SYSCALL(EpollWait, int, (Fid_t epfd, epoll_event* events, int maxevents, timeout_t timeout), (epfd, events, maxevents, timeout))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(WaitOnAddress, int, (volatile int* addr, int expected, timeout_t timeout), (addr, expected, timeout))\
+SYSCALL(WakeAddress, int, (volatile int* addr, int n), (addr, n))\
+SYSCALL(SemaphoreDown, int, (Semaphore* sem, timeout_t timeout), (sem, timeout))\
+SYSCALL(SemaphoreUp, int, (Semaphore* sem), (sem))\
+SYSCALL(BarrierWait, int, (Barrier* bar, unsigned int n), (bar, n))\
 
 
 
@@ -12,20 +12,35 @@
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+  return sys_CreateThreadStack(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
+{
+  if(stack_size != 0 && stack_size < THREAD_STACK_MIN)
+    return NOTHREAD;
+
+  ksem_lock(&proc_lock);
+
 	PCB* curproc = CURPROC;
   PTCB* ptcb = initialize_ptcb();
   ptcb->task = task;
   ptcb->argl = argl;
   ptcb->args = args;
 
-  ptcb->tcb = spawn_thread(curproc, ptcb, start_thread);
+  ptcb->tcb = spawn_thread(curproc, ptcb, start_thread, stack_size);
   Tid_t tid = (Tid_t)(ptcb->tcb->ptcb);
 
   rlist_push_front(&curproc->ptcb_list, &ptcb->ptcb_list_node);
   curproc->thread_count++;
 
-  wakeup(ptcb->tcb);
+  ksem_unlock(&proc_lock);
 
+  /* Wake up the thread after unlocking, else it may preempt us and block on the lock */
+  wakeup(ptcb->tcb);
   return tid;
 }
 
@@ -42,7 +57,7 @@ Tid_t sys_ThreadSelf()
 /**
   @brief Join the given thread.
   */
-int sys_ThreadJoin(Tid_t tid, int* exitval)
+static int thread_join(Tid_t tid, int* exitval)
 {
 
 if(tid == NOTHREAD || tid == sys_ThreadSelf())  //Error cases: A thread tries to join a thread with invalid ID or tries to join itself.
@@ -59,7 +74,7 @@ if(tid == NOTHREAD || tid == sys_ThreadSelf())  //Error cases: A thread tries to
     
   node->ptcb->refcount++;
   while(node->ptcb->exited==0 && node->ptcb->detached==0){    //We join if its not exited and detached
-    kernel_wait(&node->ptcb->exit_cv, SCHED_USER); //We will get back here only when the thread we joined calls kernel_broadcast(if it becomes detached or if it exis.)
+    ksem_wait(&proc_lock, &node->ptcb->exit_cv, SCHED_USER); //We will get back here only when the thread we joined calls Cond_Broadcast(if it becomes detached or if it exis.)
   }
   node->ptcb->refcount--;
   
@@ -74,16 +89,24 @@ if(tid == NOTHREAD || tid == sys_ThreadSelf())  //Error cases: A thread tries to
   if(node->ptcb->refcount==0){                //In case that many threads (T1,T2) joined a thread (T3) then when T3 broadcasts T1 and T2 they will not run in parallel
     rlist_remove(&node->ptcb->ptcb_list_node);//They will be scheduled by our scheduler so one of them will get here first (T1) and it would remove the ptcb                                             //so the other thread (T2) will not be able to find the ptcb and will lead to a segmentation fault.
     free(node->ptcb);                         //so the other thread T2 will not be able to find ptcb and lead to a segmentation fault.
-    return 0;                                 //Thats why we make sure ONLY the last thread that comes here after the kernel_broadcast will clean the ptcb.
+    return 0;                                 //Thats why we make sure ONLY the last thread that comes here after the Cond_Broadcast will clean the ptcb.
   }
 return 0;
 
 }
 
+int sys_ThreadJoin(Tid_t tid, int* exitval)
+{
+  ksem_lock(&proc_lock);
+  int ret = thread_join(tid, exitval);
+  ksem_unlock(&proc_lock);
+  return ret;
+}
+
 /**
   @brief Detach the given thread.
   */
-int sys_ThreadDetach(Tid_t tid)
+static int thread_detach(Tid_t tid)
 {
   if(tid == NOTHREAD)
     return -1;
@@ -98,17 +121,27 @@ int sys_ThreadDetach(Tid_t tid)
   else
   {
     node->ptcb->detached = 1;
-    kernel_broadcast(&node->ptcb->exit_cv); //We are now detached so we wake up any thread that is waiting for us because there's no reason to wait anymore
+    Cond_Broadcast(&node->ptcb->exit_cv); //We are now detached so we wake up any thread that is waiting for us because there's no reason to wait anymore
     return 0;
   }
   
 }
 
+int sys_ThreadDetach(Tid_t tid)
+{
+  ksem_lock(&proc_lock);
+  int ret = thread_detach(tid);
+  ksem_unlock(&proc_lock);
+  return ret;
+}
+
 void sys_ThreadExit(int exitval)
 {
     PCB* curproc = CURPROC;
     TCB* curthread = cur_thread();
 
+    ksem_lock(&proc_lock);
+
     /* ---------------- CASE 1: Last thread of the process ---------------- */
     if (curproc->thread_count == 1) {
 
@@ -136,13 +169,13 @@ void sys_ThreadExit(int exitval)
         /* Move exited children to init’s exited list */
         if (!is_rlist_empty(&curproc->exited_list)) {
             rlist_append(&initpcb->exited_list, &curproc->exited_list);
-            kernel_broadcast(&initpcb->child_exit);
+            Cond_Broadcast(&initpcb->child_exit);
         }
 
         /* If not init process, notify parent */
         if (get_pid(curproc) != 1) {
             rlist_push_front(&curproc->parent->exited_list, &curproc->exited_node);
-            kernel_broadcast(&curproc->parent->child_exit);
+            Cond_Broadcast(&curproc->parent->child_exit);
         }
 
         assert(is_rlist_empty(&curproc->children_list));
@@ -165,21 +198,21 @@ void sys_ThreadExit(int exitval)
         /* Mark this thread and process as exited */
         curthread->ptcb->exitval = exitval;
         curthread->ptcb->exited = 1;
-        kernel_broadcast(&curthread->ptcb->exit_cv); // consistency
+        Cond_Broadcast(&curthread->ptcb->exit_cv); // consistency
         curproc->thread_count--;
 
         curproc->main_thread = NULL;
         curproc->pstate = ZOMBIE;
 
         /* Sleep forever */
-        kernel_sleep(EXITED, SCHED_USER);
+        ksem_sleep(&proc_lock, EXITED, SCHED_USER);
         return;
     }
 
     /* ---------------- CASE 2: Normal (not last) thread ---------------- */
     curthread->ptcb->exitval = exitval;
     curthread->ptcb->exited  = 1;
-    kernel_broadcast(&curthread->ptcb->exit_cv);  // wake all joiners
+    Cond_Broadcast(&curthread->ptcb->exit_cv);  // wake all joiners
     curproc->thread_count--;
 
     if (curthread->ptcb->detached) {
@@ -195,7 +228,7 @@ void sys_ThreadExit(int exitval)
     }
 
     /* Sleep permanently — scheduler will clean the TCB. */
-    kernel_sleep(EXITED, SCHED_USER);
+    ksem_sleep(&proc_lock, EXITED, SCHED_USER);
 }
 
 
@@ -0,0 +1,1161 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "util.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+#include "unit_testing.h"
+
+
+/* Unit tests and benchmarks for kernel internals */
+
+
+static void mark_time(struct timeval* t)
+{
+	CHECK(gettimeofday(t, NULL));
+}
+
+static double time_since(struct timeval* t0)
+{
+	struct timeval t1;
+	mark_time(&t1);
+
+	return ((double)(t1.tv_sec-t0->tv_sec)) + 1E-6* (t1.tv_usec - t0->tv_usec);
+}
+
+
+/*********************************************
+ *
+ *  Timer wheel
+ *
+ *********************************************/
+
+#define TICK (1ull << TIMER_WHEEL_TICK_SHIFT)
+
+/* Make an array of fake TCBs, to be queued into a timer wheel */
+static TCB* make_sleepers(uint n)
+{
+	TCB* tcb = calloc(n, sizeof(TCB));
+	CHECK_CONDITION(tcb!=NULL);
+	for(uint i=0; i<n; i++) {
+		rlnode_init(&tcb[i].sched_node, &tcb[i]);
+		tcb[i].wakeup_time = NO_TIMEOUT;
+	}
+	return tcb;
+}
+
+
+BARE_TEST(test_timer_wheel_expiry,
+	"Test that threads expire from the timer wheel, but not before their wakeup time."
+	)
+{
+	const uint N = 5000;
+	TCB* tcb = make_sleepers(N);
+	TimerDuration expired_at[N];
+
+	timer_wheel tw;
+	TimerDuration now = 1000000007ull;
+	timer_wheel_init(&tw, now);
+
+	srand(1);
+	for(uint i=0; i<N; i++) {
+		/* Mostly short timeouts, but some span every level of the wheel */
+		TimerDuration timeout = (i%10) ? rand() % 100000 : ((TimerDuration)rand() << (i%7)) % (1ull<<36);
+		tcb[i].wakeup_time = now + timeout;
+		expired_at[i] = NO_TIMEOUT;
+		timer_wheel_insert(&tw, &tcb[i]);
+	}
+	ASSERT(tw.count == N);
+
+	/* Remove every 3rd thread */
+	for(uint i=0; i<N; i+=3)
+		timer_wheel_remove(&tw, &tcb[i]);
+
+	TimerDuration wake[N];
+	for(uint i=0; i<N; i++) wake[i] = tcb[i].wakeup_time;
+
+	rlnode expired;
+	rlnode_init(&expired, NULL);
+	while(tw.count > 0) {
+		/* Advance by irregular steps */
+		now += (rand() % 3) ? rand() % (4*TICK) : rand() % (1ull<<28);
+		timer_wheel_advance(&tw, now, &expired);
+		while(! is_rlist_empty(&expired)) {
+			TCB* t = rlist_pop_front(&expired)->tcb;
+			ASSERT(t->wakeup_time == NO_TIMEOUT);
+			expired_at[t - tcb] = now;
+		}
+		/* Timeouts are rounded to ticks, so only threads of past ticks must have expired */
+		TimerDuration next = timer_wheel_next(&tw);
+		for(uint i=0; i<N; i++)
+			if(i%3 && expired_at[i]==NO_TIMEOUT) {
+				ASSERT(wake[i] > (now & ~(TICK-1)));
+				ASSERT(next <= ((wake[i] + TICK-1) & ~(TICK-1)));
+			}
+		ASSERT((next == NO_TIMEOUT) == (tw.count == 0));
+	}
+
+	for(uint i=0; i<N; i++) {
+		if(i%3==0) {
+			ASSERT(expired_at[i]==NO_TIMEOUT);
+		} else {
+			ASSERT(expired_at[i] >= wake[i]);
+		}
+	}
+
+	free(tcb);
+}
+
+
+BARE_TEST(test_timer_wheel_tick_accuracy,
+	"Test that a thread expires at the first advance past its wakeup tick."
+	)
+{
+	TCB* tcb = make_sleepers(1);
+	timer_wheel tw;
+	TimerDuration start = 77*TICK + 5;
+
+	for(TimerDuration timeout = 1; timeout < (1ull<<26); timeout = timeout*3 + 1) {
+		timer_wheel_init(&tw, start);
+		tcb->wakeup_time = start + timeout;
+		timer_wheel_insert(&tw, tcb);
+
+		rlnode expired;
+		rlnode_init(&expired, NULL);
+		TimerDuration now = start;
+		while(is_rlist_empty(&expired)) {
+			now += TICK;
+			timer_wheel_advance(&tw, now, &expired);
+		}
+		ASSERT(now >= start + timeout);
+		ASSERT(now < start + timeout + 2*TICK);
+		ASSERT(tw.count == 0);
+		ASSERT(rlist_pop_front(&expired) == &tcb->sched_node);
+	}
+
+	free(tcb);
+}
+
+
+BARE_TEST(test_timer_wheel_next,
+	"Test that the next advance time of the timer wheel is never later than the earliest timeout, "
+	"under random inserts, removals and advances."
+	)
+{
+	const uint N = 200;
+	TCB* tcb = make_sleepers(N);
+	int inwheel[N];
+	memset(inwheel, 0, sizeof(inwheel));
+
+	timer_wheel tw;
+	TimerDuration now = 1000000007ull;
+	timer_wheel_init(&tw, now);
+
+	srand(3);
+	for(uint step=0; step < 200000; step++) {
+		uint i = rand() % N;
+		switch(rand() % 4) {
+		case 0:
+			if(! inwheel[i]) {
+				tcb[i].wakeup_time = now + rand() % 1000000;
+				timer_wheel_insert(&tw, &tcb[i]);
+				inwheel[i] = 1;
+			}
+			break;
+		case 1:
+			if(inwheel[i]) {
+				timer_wheel_remove(&tw, &tcb[i]);
+				tcb[i].wakeup_time = NO_TIMEOUT;
+				inwheel[i] = 0;
+			}
+			break;
+		case 2: {
+			now += rand() % 50000;
+			rlnode expired;
+			rlnode_init(&expired, NULL);
+			timer_wheel_advance(&tw, now, &expired);
+			while(! is_rlist_empty(&expired))
+				inwheel[rlist_pop_front(&expired)->tcb - tcb] = 0;
+			break;
+		}
+		default: {
+			/* An advance at the returned time must not miss any timeout */
+			TimerDuration next = timer_wheel_next(&tw);
+			for(uint j=0; j<N; j++)
+				if(inwheel[j])
+					ASSERT(next <= ((tcb[j].wakeup_time + TICK-1) & ~(TICK-1)));
+		}
+		}
+	}
+
+	free(tcb);
+}
+
+
+TEST_SUITE(timer_wheel_tests,
+	"Tests for the timer wheel of the scheduler."
+	)
+{
+	&test_timer_wheel_expiry,
+	&test_timer_wheel_tick_accuracy,
+	&test_timer_wheel_next,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *  Thread pool
+ *
+ *********************************************/
+
+static int null_thread(int argl, void* args)
+{
+	return argl;
+}
+
+BOOT_TEST(test_thread_pool_reuse,
+	"Test that the TCB+stack blocks of released threads are reused, that the pools "
+	"do not exceed their high-water mark, and that only default-size blocks count as overflows."
+	)
+{
+	for(int i=0; i<100; i++) {
+		Tid_t t = CreateThread(null_thread, i, NULL);
+		int exitval;
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval == i);
+	}
+
+	unsigned long hits = 0, misses = 0;
+	for(uint c=0; c<cpu_cores(); c++) {
+		hits += cctx[c].thread_pool_hits;
+		misses += cctx[c].thread_pool_misses;
+		ASSERT(cctx[c].thread_pool_size <= THREAD_POOL_HIGH_WATER);
+	}
+	ASSERT(hits + misses >= 100);
+	ASSERT(hits > 0);
+
+	/* Blocks of other sizes are freed, but they do not overflow the pool */
+	unsigned long overflows = 0;
+	for(uint c=0; c<cpu_cores(); c++)
+		overflows += cctx[c].thread_pool_overflows;
+	for(int i=0; i<10; i++) {
+		Tid_t t = CreateThreadStack(null_thread, i, NULL, THREAD_STACK_MIN);
+		ASSERT(ThreadJoin(t, NULL)==0);
+	}
+	for(uint c=0; c<cpu_cores(); c++)
+		overflows -= cctx[c].thread_pool_overflows;
+	ASSERT(overflows == 0);
+	return 0;
+}
+
+
+TEST_SUITE(thread_pool_tests,
+	"Tests for the per-core pools of thread blocks."
+	)
+{
+	&test_thread_pool_reuse,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *  Scheduler
+ *
+ *********************************************/
+
+static volatile TimerDuration demoted_after, boosted_after;
+
+/* Spin for a while. Alone on its core, a thread gets no quantum alarm, so it
+   calls yield() itself, to be charged for the time it used. */
+static TimerDuration spin_and_yield(TimerDuration t0)
+{
+	TimerDuration t = bios_clock();
+	while(bios_clock() - t < QUANTUM/10)
+		;
+	yield(SCHED_USER);
+	return bios_clock() - t0;
+}
+
+/* Spin until we are demoted from the top level, and then until we are boosted back */
+static int cpu_bound_thread(int argl, void* args)
+{
+	TCB* self = cur_thread();
+	TimerDuration t0 = bios_clock(), limit = 5*PRIORITY_BOOST_PERIOD, t = 0;
+
+	while(self->priority == PQ-1 && t < limit)
+		t = spin_and_yield(t0);
+	demoted_after = t;
+	while(self->priority < PQ-1 && t < limit)
+		t = spin_and_yield(t0);
+	boosted_after = t - demoted_after;
+	return 0;
+}
+
+BOOT_TEST(test_priority_demotion_boost,
+	"Test that a CPU-bound thread is demoted after its allotment at the top level, "
+	"and boosted back within the boost period. The idle threads are never boosted.",
+	.timeout = 30
+	)
+{
+	Tid_t t = CreateThread(cpu_bound_thread, 0, NULL);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* The coarse clock may lag by a few milliseconds */
+	ASSERT(demoted_after + QUANTUM/2 >= PRIORITY_ALLOTMENT(PQ-1));
+	ASSERT(demoted_after < PRIORITY_BOOST_PERIOD);
+	ASSERT(boosted_after <= PRIORITY_BOOST_PERIOD + 10*QUANTUM);
+
+	/* Let the idle thread of our core run after the boost */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 2*QUANTUM/1000);
+	Mutex_Unlock(&mx);
+	for(uint c=0; c<cpu_cores(); c++)
+		ASSERT(cctx[c].idle_thread.priority == 0);
+	return 0;
+}
+
+
+TEST_SUITE(sched_tests,
+	"Tests for the multilevel feedback queue scheduler."
+	)
+{
+	&test_priority_demotion_boost,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *  Mutexes
+ *
+ *********************************************/
+
+static Mutex counter_mx;
+static volatile uint counter;
+
+/* Increment the counter, yielding inside the critical section to force contention */
+static int mutex_incr_thread(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		Mutex_Lock(&counter_mx);
+		uint c = counter;
+		if(i % 4 == 0) yield(SCHED_USER);
+		counter = c+1;
+		Mutex_Unlock(&counter_mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_contention,
+	"Test that a contended mutex provides mutual exclusion, when its owner is preempted "
+	"inside the critical section."
+	)
+{
+	const uint T = 16, N = 2000;
+	counter_mx = MUTEX_INIT;
+	counter = 0;
+
+	Tid_t tid[T];
+	for(uint i=0; i<T; i++)
+		tid[i] = CreateThread(mutex_incr_thread, N, NULL);
+	for(uint i=0; i<T; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+
+	ASSERT(counter == T*N);
+	ASSERT(counter_mx.locked == 0);
+	ASSERT(counter_mx.owner == NULL);
+	ASSERT(counter_mx.waitq == NULL);
+	ASSERT(counter_mx.spinq == NULL);
+	return 0;
+}
+
+
+static ksem_t test_sem;
+static volatile uint sem_order[8], sem_served;
+
+static int ksem_fifo_thread(int argl, void* args)
+{
+	ksem_lock(&test_sem);
+	sem_order[sem_served++] = argl;
+	ksem_unlock(&test_sem);
+	return 0;
+}
+
+/* The waiters are a ring of nodes, each at the start of its waiter */
+static uint ksem_queued(ksem_t* sem)
+{
+	rlnode* q = sem->waitq;
+	return q ? 1+rlist_len(q) : 0;
+}
+
+BOOT_TEST(test_ksem_fifo,
+	"Test that a kernel semaphore is handed to its waiters in arrival order."
+	)
+{
+	const uint T = 8;
+	test_sem = KSEM_INIT;
+	sem_served = 0;
+
+	ksem_lock(&test_sem);
+	Tid_t tid[T];
+	for(uint i=0; i<T; i++) {
+		tid[i] = CreateThread(ksem_fifo_thread, i, NULL);
+		while(ksem_queued(&test_sem) < i+1)
+			yield(SCHED_USER);
+	}
+	ksem_unlock(&test_sem);
+
+	for(uint i=0; i<T; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	ASSERT(sem_served == T);
+	for(uint i=0; i<T; i++)
+		ASSERT(sem_order[i] == i);
+	ASSERT(test_sem.count == 1);
+	ASSERT(test_sem.waitq == NULL);
+	return 0;
+}
+
+
+BOOT_TEST(test_mutex_owner,
+	"Test that a mutex records its owner thread."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	Mutex_Lock(&mx);
+	ASSERT(mx.owner == cur_thread());
+	Mutex_Unlock(&mx);
+	ASSERT(mx.owner == NULL);
+	return 0;
+}
+
+
+static Mutex pi_mx;
+static volatile int pi_locked, pi_lent, pi_restored;
+
+/* Hold the mutex at the lowest priority, until someone lends us theirs */
+static int pi_owner_thread(int argl, void* args)
+{
+	TCB* self = cur_thread();
+	Mutex_Lock(&pi_mx);
+	self->priority = 0;
+	pi_locked = 1;
+	for(int i=0; i<100000 && self->inherited_priority < 0; i++)
+		yield(SCHED_USER);
+	pi_lent = self->inherited_priority;
+	Mutex_Unlock(&pi_mx);
+	pi_restored = (self->inherited_priority == -1);
+	return 0;
+}
+
+BOOT_TEST(test_priority_inheritance,
+	"Test that the owner of a mutex inherits the priority of a sleeping waiter, "
+	"and gives it back when it unlocks."
+	)
+{
+	pi_mx = MUTEX_INIT;
+	pi_locked = 0;
+	pi_lent = -1;
+	pi_restored = 0;
+
+	Tid_t tid = CreateThread(pi_owner_thread, 0, NULL);
+	while(! pi_locked) yield(SCHED_USER);
+
+	Mutex_Lock(&pi_mx);
+	Mutex_Unlock(&pi_mx);
+	ASSERT(ThreadJoin(tid, NULL)==0);
+
+	/* With more cores, the waiter may just spin while the owner runs */
+	if(cpu_cores()==1)
+		ASSERT(pi_lent > 0);
+	ASSERT(pi_restored);
+	return 0;
+}
+
+
+static Mutex pi_mx2;
+static volatile int pi_kept;
+
+static int pi_lenders(TCB* tcb)
+{
+	int n = 0;
+	for(int p=0; p<PQ; p++) n += tcb->lenders[p];
+	return n;
+}
+
+/* Hold two mutexes until a waiter of each lends us its priority */
+static int pi_owner2_thread(int argl, void* args)
+{
+	TCB* self = cur_thread();
+	Mutex_Lock(&pi_mx);
+	Mutex_Lock(&pi_mx2);
+	self->priority = 0;
+	pi_locked = 1;
+	for(int i=0; i<100000 && pi_lenders(self) < 2; i++)
+		yield(SCHED_USER);
+	pi_lent = pi_lenders(self);
+	Mutex_Unlock(&pi_mx);
+	pi_kept = (pi_lent < 2) || (self->inherited_priority >= 0);
+	Mutex_Unlock(&pi_mx2);
+	pi_restored = (self->inherited_priority == -1);
+	return 0;
+}
+
+static int pi_waiter_thread(int argl, void* args)
+{
+	Mutex* mx = args;
+	Mutex_Lock(mx);
+	Mutex_Unlock(mx);
+	return 0;
+}
+
+BOOT_TEST(test_priority_inheritance_two_locks,
+	"Test that the owner of two contended mutexes keeps the priority lent "
+	"through the second, after it unlocks the first."
+	)
+{
+	pi_mx = MUTEX_INIT;
+	pi_mx2 = MUTEX_INIT;
+	pi_locked = 0;
+	pi_lent = -1;
+	pi_kept = 0;
+	pi_restored = 0;
+
+	Tid_t tid = CreateThread(pi_owner2_thread, 0, NULL);
+	while(! pi_locked) yield(SCHED_USER);
+
+	Tid_t w1 = CreateThread(pi_waiter_thread, 0, &pi_mx);
+	Tid_t w2 = CreateThread(pi_waiter_thread, 0, &pi_mx2);
+	ASSERT(ThreadJoin(w1, NULL)==0);
+	ASSERT(ThreadJoin(w2, NULL)==0);
+	ASSERT(ThreadJoin(tid, NULL)==0);
+
+	if(cpu_cores()==1)
+		ASSERT(pi_lent == 2);
+	ASSERT(pi_kept);
+	ASSERT(pi_restored);
+	return 0;
+}
+
+
+static TCB* volatile pi_dead_owner;
+
+static int pi_exit_holding_thread(int argl, void* args)
+{
+	Mutex_Lock(&pi_mx);
+	pi_dead_owner = cur_thread();
+	return 0;
+}
+
+BOOT_TEST(test_mutex_owner_exits,
+	"Test that a thread that exits holding a mutex is kept, and not lent any "
+	"priority, while a waiter sleeps at the mutex."
+	)
+{
+	pi_mx = MUTEX_INIT;
+	pi_dead_owner = NULL;
+
+	Tid_t tid = CreateThread(pi_exit_holding_thread, 0, NULL);
+	ASSERT(ThreadJoin(tid, NULL)==0);
+	TCB* owner = pi_dead_owner;
+	ASSERT(owner != NULL && pi_mx.owner == owner);
+	while(owner->state != EXITED) yield(SCHED_USER);
+	ASSERT(owner->held_mutexes == 1);
+
+	Tid_t w = CreateThread(pi_waiter_thread, 0, &pi_mx);
+	while(pi_mx.waitq == NULL) yield(SCHED_USER);
+	ASSERT(owner->state == EXITED);
+	ASSERT(owner->inherited_priority == -1);
+
+	/* Release it for the dead owner */
+	Mutex_Unlock(&pi_mx);
+	ASSERT(ThreadJoin(w, NULL)==0);
+	ASSERT(owner->held_mutexes == 0);
+	ASSERT(pi_mx.owner == NULL);
+	return 0;
+}
+
+
+static krwlock_t test_rw;
+static volatile int readers_in, writers_in;
+
+static int rwlock_thread(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		if(i % 5 == 0) {
+			krw_write_lock(&test_rw);
+			ASSERT(__atomic_add_fetch(&writers_in, 1, __ATOMIC_SEQ_CST)==1);
+			ASSERT(readers_in == 0);
+			yield(SCHED_USER);
+			__atomic_sub_fetch(&writers_in, 1, __ATOMIC_SEQ_CST);
+			krw_write_unlock(&test_rw);
+		} else {
+			krw_read_lock(&test_rw);
+			__atomic_add_fetch(&readers_in, 1, __ATOMIC_SEQ_CST);
+			ASSERT(writers_in == 0);
+			yield(SCHED_USER);
+			__atomic_sub_fetch(&readers_in, 1, __ATOMIC_SEQ_CST);
+			krw_read_unlock(&test_rw);
+		}
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rwlock,
+	"Test that a reader-writer lock admits either many readers or a single writer."
+	)
+{
+	const uint T = 10;
+	test_rw = KRWLOCK_INIT;
+	readers_in = writers_in = 0;
+
+	Tid_t tid[T];
+	for(uint i=0; i<T; i++)
+		tid[i] = CreateThread(rwlock_thread, 500, NULL);
+	for(uint i=0; i<T; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+
+	ASSERT(test_rw.readers == 0);
+	ASSERT(test_rw.writers_waiting == 0);
+	return 0;
+}
+
+
+#define RCU_MAGIC 0x5eed
+struct rcu_obj { int magic; };
+static struct rcu_obj* volatile rcu_ptr;
+static volatile int rcu_done;
+
+static int rcu_reader(int argl, void* args)
+{
+	while(! rcu_done) {
+		rcu_read_lock();
+		struct rcu_obj* p = rcu_dereference(rcu_ptr);
+		rcu_read_lock();  /* nested */
+		ASSERT(p->magic == RCU_MAGIC);
+		rcu_read_unlock();
+		/* Stay a while, so that the writer runs during the section */
+		for(int i=0; i<1000; i++)
+			ASSERT(p->magic == RCU_MAGIC);
+		rcu_read_unlock();
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rcu_reclaim,
+	"Test that an object unpublished under RCU is not reclaimed while readers may see it."
+	)
+{
+	const uint T = 4, N = 20000;
+	/* Reclaimed objects are poisoned, and never reused */
+	struct rcu_obj* obj = malloc(N*sizeof(struct rcu_obj));
+	obj[0].magic = RCU_MAGIC;
+	rcu_ptr = &obj[0];
+	rcu_done = 0;
+
+	Tid_t tid[T];
+	for(uint i=0; i<T; i++)
+		tid[i] = CreateThread(rcu_reader, 0, NULL);
+
+	for(uint i=1; i<N; i++) {
+		obj[i].magic = RCU_MAGIC;
+		rcu_assign_pointer(rcu_ptr, &obj[i]);
+		rcu_synchronize();
+		obj[i-1].magic = 0;
+		if(i % 100 == 0) yield(SCHED_USER);
+	}
+
+	rcu_done = 1;
+	for(uint i=0; i<T; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	free(obj);
+	return 0;
+}
+
+BOOT_TEST(test_rcu_gp,
+	"Test that objects unpublished before a grace period started are reclaimed "
+	"only after rcu_gp_done() returns true, without waiting for it."
+	)
+{
+	const uint T = 4, N = 20000;
+	struct rcu_obj* obj = malloc(N*sizeof(struct rcu_obj));
+	obj[0].magic = RCU_MAGIC;
+	rcu_ptr = &obj[0];
+	rcu_done = 0;
+
+	Tid_t tid[T];
+	for(uint i=0; i<T; i++)
+		tid[i] = CreateThread(rcu_reader, 0, NULL);
+
+	/* The objects before limit wait for gp */
+	rcu_gp gp;
+	uint freed = 0, limit = 0, periods = 0;
+	rcu_gp_start(&gp);
+	for(uint i=1; i<N; i++) {
+		obj[i].magic = RCU_MAGIC;
+		rcu_assign_pointer(rcu_ptr, &obj[i]);
+		if(rcu_gp_done(&gp)) {
+			for(; freed < limit; freed++)
+				obj[freed].magic = 0;
+			limit = i;
+			rcu_gp_start(&gp);
+			periods++;
+		}
+		if(i % 100 == 0) yield(SCHED_USER);
+	}
+	ASSERT(periods > 0);
+
+	rcu_done = 1;
+	for(uint i=0; i<T; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	free(obj);
+	return 0;
+}
+
+
+#if LOCK_STATS
+BOOT_TEST(test_lock_stats,
+	"Test that the lock statistics count the acquisitions of a mutex."
+	)
+{
+	static Mutex mx = MUTEX_INIT;
+	lock_stats_t ls;
+	ASSERT(lock_stats_get(&mx, "mutex", &ls)==0);
+	for(int i=0; i<10; i++) {
+		Mutex_Lock(&mx);
+		Mutex_Unlock(&mx);
+	}
+	ASSERT(lock_stats_get(&mx, "mutex", &ls)==1);
+	ASSERT(ls.acquisitions == 10);
+	ASSERT(ls.contended == 0);
+	return 0;
+}
+#endif
+
+
+TEST_SUITE(mutex_tests,
+	"Tests for the kernel mutexes, semaphores, reader-writer locks and RCU."
+	)
+{
+	&test_mutex_contention,
+	&test_mutex_owner,
+	&test_ksem_fifo,
+	&test_priority_inheritance,
+	&test_priority_inheritance_two_locks,
+	&test_mutex_owner_exits,
+	&test_rwlock,
+	&test_rcu_reclaim,
+	&test_rcu_gp,
+#if LOCK_STATS
+	&test_lock_stats,
+#endif
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *  Benchmarks
+ *
+ *********************************************/
+
+
+BARE_TEST(bench_timer_wheel,
+	"Measure the cost of arming and expiring 50000 timed waits in the timer wheel.",
+	.timeout = 60
+	)
+{
+	const uint N = 50000;
+	TCB* tcb = make_sleepers(N);
+
+	timer_wheel tw;
+	TimerDuration now = 1000000007ull;
+	timer_wheel_init(&tw, now);
+
+	/* Timeouts up to 10 seconds */
+	srand(2);
+	for(uint i=0; i<N; i++)
+		tcb[i].wakeup_time = now + (rand() % 10000000);
+
+	struct timeval t0;
+	mark_time(&t0);
+	for(uint i=0; i<N; i++)
+		timer_wheel_insert(&tw, &tcb[i]);
+	double Tins = time_since(&t0);
+
+	/* Cancel half of them, as if woken up by a signal */
+	mark_time(&t0);
+	for(uint i=0; i<N; i+=2)
+		timer_wheel_remove(&tw, &tcb[i]);
+	double Trem = time_since(&t0);
+
+	/* Expire the rest, one quantum at a time */
+	rlnode expired;
+	rlnode_init(&expired, NULL);
+	uint nexp = 0;
+	mark_time(&t0);
+	while(tw.count > 0) {
+		now += QUANTUM;
+		timer_wheel_advance(&tw, now, &expired);
+		while(! is_rlist_empty(&expired)) {
+			rlist_pop_front(&expired);
+			nexp++;
+		}
+	}
+	double Texp = time_since(&t0);
+	ASSERT(nexp == N/2);
+
+	MSG("insert: %.1f nsec/op   cancel: %.1f nsec/op   expire: %.1f nsec/op\n",
+		1E9*Tins/N, 1E9*Trem/(N/2), 1E9*Texp/nexp);
+
+	free(tcb);
+}
+
+
+static pipe_t ping, pong;
+
+static int pong_thread(int argl, void* args)
+{
+	char c;
+	for(int i=0; i<argl; i++) {
+		ASSERT(Read(ping.read, &c, 1) == 1);
+		ASSERT(Write(pong.write, &c, 1) == 1);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_pingpong,
+	"Measure the round-trip latency of one byte sent back and forth between two threads over pipes.",
+	.timeout = 60
+	)
+{
+	const uint N = 20000;
+
+	ASSERT(Pipe(&ping)==0);
+	ASSERT(Pipe(&pong)==0);
+	Tid_t t = CreateThread(pong_thread, N, NULL);
+
+	struct timeval t0;
+	mark_time(&t0);
+	for(uint i=0; i<N; i++) {
+		char c = i;
+		ASSERT(Write(ping.write, &c, 1) == 1);
+		ASSERT(Read(pong.read, &c, 1) == 1);
+		ASSERT(c == (char) i);
+	}
+	double T = time_since(&t0);
+
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	MSG("round trip: %.2f usec\n", 1E6*T/N);
+	return 0;
+}
+
+
+static pipe_t bulk;
+
+static int pipe_drain_thread(int argl, void* args)
+{
+	static char buf[1 << 16];
+	size_t total = 0;
+	int n;
+	while((n = Read(bulk.read, buf, argl)) > 0)
+		total += n;
+	ASSERT(total == *(size_t*)args);
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_throughput,
+	"Measure the throughput of a pipe between two threads, for writes (and reads) "
+	"of 1 byte, 64 bytes, 4 kbytes and 64 kbytes, and of 64 kbytes to a pipe "
+	"enlarged to 1 Mbyte.",
+	.timeout = 120
+	)
+{
+	static char buf[1 << 16];
+	const uint sizes[] = { 1, 64, 4096, 65536, 65536 };
+
+	for(uint k=0; k<5; k++) {
+		uint size = sizes[k];
+		int large = (k == 4);
+		/* Fewer bytes for small writes, to keep the run short */
+		size_t total = (size < 4096) ? (size << 14) : (64u << 20);
+
+		ASSERT(Pipe(&bulk)==0);
+		if(large)
+			ASSERT(PipeCapacity(bulk.write, PIPE_MAX_CAPACITY)==PIPE_MAX_CAPACITY);
+		Tid_t t = CreateThread(pipe_drain_thread, size, &total);
+
+		struct timeval t0;
+		mark_time(&t0);
+		for(size_t sent = 0; sent < total; ) {
+			int n = Write(bulk.write, buf, (total-sent < size) ? total-sent : size);
+			ASSERT(n > 0);
+			sent += n;
+		}
+		ASSERT(Close(bulk.write)==0);
+		ASSERT(ThreadJoin(t, NULL)==0);
+		double T = time_since(&t0);
+		ASSERT(Close(bulk.read)==0);
+
+		MSG("%5u byte writes%s: %8.2f Mbytes/sec\n", size, 
+			large ? " (1 Mbyte pipe)" : "", total/T/1E6);
+	}
+	return 0;
+}
+
+
+static pipe_t relay_in, relay_out;
+
+/* Move everything from relay_in to relay_out, with Splice or with Read and Write */
+static int relay_thread(int argl, void* args)
+{
+	static char buf[1 << 16];
+	int n;
+	if(argl) {
+		while((n = Splice(relay_in.read, relay_out.write, sizeof(buf))) > 0)
+			;
+	} else {
+		while((n = Read(relay_in.read, buf, sizeof(buf))) > 0)
+			for(int w = 0; w < n; ) {
+				int rc = Write(relay_out.write, buf + w, n - w);
+				ASSERT(rc > 0);
+				w += rc;
+			}
+	}
+	ASSERT(n == 0);
+	ASSERT(Close(relay_out.write)==0);
+	return 0;
+}
+
+static int relay_drain_thread(int argl, void* args)
+{
+	static char buf[1 << 16];
+	size_t total = 0;
+	int n;
+	while((n = Read(relay_out.read, buf, sizeof(buf))) > 0)
+		total += n;
+	ASSERT(total == *(size_t*)args);
+	return 0;
+}
+
+BOOT_TEST(bench_splice_relay,
+	"Measure the throughput of a thread relaying 64 kbyte writes from one pipe "
+	"to another, both of 64 kbytes, with Read and Write and with Splice.",
+	.timeout = 120
+	)
+{
+	static char buf[1 << 16];
+	size_t total = 64u << 20;
+
+	for(int splice = 0; splice < 2; splice++) {
+		ASSERT(Pipe(&relay_in)==0);
+		ASSERT(Pipe(&relay_out)==0);
+		ASSERT(PipeCapacity(relay_in.write, 1 << 16)==(1 << 16));
+		ASSERT(PipeCapacity(relay_out.write, 1 << 16)==(1 << 16));
+		Tid_t relay = CreateThread(relay_thread, splice, NULL);
+		Tid_t drain = CreateThread(relay_drain_thread, 0, &total);
+
+		struct timeval t0;
+		mark_time(&t0);
+		for(size_t sent = 0; sent < total; ) {
+			int n = Write(relay_in.write, buf, sizeof(buf));
+			ASSERT(n > 0);
+			sent += n;
+		}
+		ASSERT(Close(relay_in.write)==0);
+		ASSERT(ThreadJoin(relay, NULL)==0);
+		ASSERT(ThreadJoin(drain, NULL)==0);
+		double T = time_since(&t0);
+		ASSERT(Close(relay_in.read)==0);
+		ASSERT(Close(relay_out.read)==0);
+
+		MSG("%s: %8.2f Mbytes/sec\n", splice ? "Splice    " : "Read/Write", total/T/1E6);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(bench_thread_create_join,
+	"Measure the latency of creating and joining a thread.",
+	.timeout = 60
+	)
+{
+	const uint N = 20000;
+
+	struct timeval t0;
+	mark_time(&t0);
+	for(uint i=0; i<N; i++) {
+		Tid_t t = CreateThread(null_thread, 0, NULL);
+		ASSERT(ThreadJoin(t, NULL)==0);
+	}
+	double T = time_since(&t0);
+
+	MSG("create+join: %.2f usec\n", 1E6*T/N);
+	return 0;
+}
+
+
+static volatile uint yield_count;
+
+static int yield_thread(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		yield_count++;
+		yield(SCHED_USER);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_mutex_contention,
+	"Measure the cost of a lock/unlock pair of a mutex contended by 100 threads.",
+	.timeout = 60
+	)
+{
+	const uint T = 100, N = 2000;
+	counter_mx = MUTEX_INIT;
+	counter = 0;
+
+	struct timeval t0;
+	mark_time(&t0);
+	Tid_t tid[T];
+	for(uint i=0; i<T; i++)
+		tid[i] = CreateThread(mutex_incr_thread, N, NULL);
+	for(uint i=0; i<T; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	double Tm = time_since(&t0);
+
+	ASSERT(counter == T*N);
+	MSG("lock/unlock: %.2f usec\n", 1E6*Tm/(T*N));
+	return 0;
+}
+
+
+BOOT_TEST(bench_yield_pingpong,
+	"Measure the cost of a context switch, by two threads yielding to each other.",
+	.timeout = 60
+	)
+{
+	const uint N = 100000;
+	yield_count = 0;
+	Tid_t t = CreateThread(yield_thread, N, NULL);
+
+	struct timeval t0;
+	mark_time(&t0);
+	yield_thread(N, NULL);
+	double T = time_since(&t0);
+
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(yield_count == 2*N);
+
+	MSG("yield: %.3f usec\n", 1E6*T/(2*N));
+	return 0;
+}
+
+
+/* A barrier made of a mutex and a condition variable, for comparison */
+static Mutex cvbar_mx;
+static CondVar cvbar_cv;
+static uint cvbar_count, cvbar_epoch;
+
+static void cvbar_wait(uint n)
+{
+	Mutex_Lock(&cvbar_mx);
+	uint epoch = cvbar_epoch;
+	if(++cvbar_count == n) {
+		cvbar_count = 0;
+		cvbar_epoch++;
+		Cond_Broadcast(&cvbar_cv);
+	}
+	while(epoch == cvbar_epoch)
+		Cond_Wait(&cvbar_mx, &cvbar_cv);
+	Mutex_Unlock(&cvbar_mx);
+}
+
+static Barrier bench_bar;
+#define BARRIER_PHASES 2000
+
+static int barrier_thread(int argl, void* args)
+{
+	for(int i=0; i<BARRIER_PHASES; i++)
+		if(argl) BarrierWait(&bench_bar, cpu_cores());
+		else cvbar_wait(cpu_cores());
+	return 0;
+}
+
+BOOT_TEST(bench_barrier,
+	"Measure the latency of a barrier phase, with one thread per core, for the "
+	"BarrierWait system call and for a barrier made of a mutex and a condition "
+	"variable. Run it with e.g. -c 2,4,8,16,32.",
+	.timeout = 120, .minimum_cores = 2
+	)
+{
+	const uint T = cpu_cores();
+
+	for(int kernel=0; kernel<2; kernel++) {
+		bench_bar = BARRIER_INITIALIZER;
+		cvbar_mx = MUTEX_INIT;
+		cvbar_cv = COND_INIT;
+		cvbar_count = cvbar_epoch = 0;
+
+		struct timeval t0;
+		mark_time(&t0);
+		Tid_t tid[T];
+		for(uint i=1; i<T; i++)
+			tid[i] = CreateThread(barrier_thread, kernel, NULL);
+		barrier_thread(kernel, NULL);
+		double Tb = time_since(&t0);
+		for(uint i=1; i<T; i++)
+			ASSERT(ThreadJoin(tid[i], NULL)==0);
+
+		MSG("%s barrier, %u threads: %.2f usec per phase\n", 
+			kernel ? "BarrierWait" : "Mutex/CondVar", T, 1E6*Tb/BARRIER_PHASES);
+	}
+	return 0;
+}
+#undef BARRIER_PHASES
+
+
+TEST_SUITE(benchmarks,
+	"Benchmarks of kernel internals. Results are printed, not checked."
+	)
+{
+	&bench_timer_wheel,
+	&bench_pipe_pingpong,
+	&bench_pipe_throughput,
+	&bench_splice_relay,
+	&bench_thread_create_join,
+	&bench_mutex_contention,
+	&bench_yield_pingpong,
+	&bench_barrier,
+	NULL
+};
+
+
+
+TEST_SUITE(all_tests,
+	"All tests")
+{
+	&timer_wheel_tests,
+	&thread_pool_tests,
+	&sched_tests,
+	&mutex_tests,
+	&benchmarks,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	return register_test(&all_tests) ||
+		run_program(argc, argv, &all_tests);
+}
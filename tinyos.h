@@ -61,6 +61,11 @@ typedef uintptr_t Tid_t;
 /** @brief The invalid thread ID */
 #define NOTHREAD ((Tid_t)0)
 
+/** @brief The minimum stack size of a thread, in bytes.
+  @see CreateThreadStack
+  @see ExecStack */
+#define THREAD_STACK_MIN (8 * 1024)
+
 
 /*******************************************
  *      Concurrency control
@@ -72,11 +77,22 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A mutex is a lock byte, plus two queues of waiters: threads that spin with
+    interrupts disabled queue up MCS-style, each spinning on its own flag, while
+    threads in the preemptive domain park in FIFO order. On unlock, ownership is
+    handed directly to the first parked waiter. The owning thread is recorded,
+    so that waiters spin only while the owner is running on some core.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef struct {
+  char locked;          /**< @brief Non-zero while held, 2 if there may be sleepers */
+  void* owner;          /**< @brief The thread holding the mutex */
+  void* spinq;          /**< @brief Tail of the queue of spinning waiters */
+  void* waitq;          /**< @brief Ring of parked waiters */
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -86,14 +102,16 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, NULL, NULL, NULL })
 
 
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
-  In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
+  in kernel-space (preemptive domain), the caller spins while the owner of the mutex
+  is running on another core, and otherwise sleeps until the mutex is handed to it
+  by @c Mutex_Unlock.
+  In scheduler space (non-preemptive domain), the mutex lock operation is a queued spinlock.
 
   @see Mutex
   @see Mutex_Unlock
@@ -133,7 +151,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, { 0, NULL, NULL, NULL } })
 
 
 /** @brief Wait on a condition variable. 
@@ -202,6 +220,108 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief Wait on an address, if it holds an expected value.
+
+  This is a low-level primitive for building synchronization objects in user 
+  code, which only need to enter the kernel on contention. If the integer at
+  @c addr equals @c expected, the calling thread sleeps until another thread 
+  calls @c WakeAddress on the same address, or the timeout expires. The 
+  comparison and the sleep happen atomically with respect to @c WakeAddress.
+
+  The thread may also wake up for other reasons, not specified, so the
+  caller should always re-check its condition.
+
+  @param addr The address to wait on.
+  @param expected The value that @c *addr must hold for the thread to sleep.
+  @param timeout The time in milliseconds to wait, or 0 to wait for ever.
+  @returns 0 if the thread was woken up by @c WakeAddress, else -1. Possible 
+     reasons for failure are:
+     - @c addr is NULL.
+     - @c *addr was not equal to @c expected.
+     - the timeout expired.
+  @see WakeAddress
+  */
+int WaitOnAddress(volatile int* addr, int expected, timeout_t timeout);
+
+
+/** @brief Wake up threads waiting on an address.
+
+  Wake up to @c n threads blocked in @c WaitOnAddress on @c addr, in the 
+  order they started waiting. If @c n is negative, all of them are woken up.
+
+  @param addr The address that the threads wait on.
+  @param n The maximum number of threads to wake up.
+  @returns the number of threads woken up.
+  @see WaitOnAddress
+  */
+int WakeAddress(volatile int* addr, int n);
+
+
+/** @brief A counting semaphore.
+
+  The semaphore lives in user memory, and its operations are system calls.
+  A thread that must wait first spins for a short while, if there are other
+  cores, and only then sleeps.
+
+  @see SEMAPHORE_INIT
+  @see SemaphoreDown
+  @see SemaphoreUp
+ */
+typedef struct semaphore {
+	volatile int count;		/**< @brief The semaphore value, never negative */
+	volatile int sleepers;	/**< @brief The number of threads asleep in @c SemaphoreDown */
+} Semaphore;
+
+/** @brief Initializer for a semaphore with value @c n. */
+#define SEMAPHORE_INIT(n) ((Semaphore){ (n), 0 })
+
+/** @brief Decrement a semaphore, waiting while its value is 0.
+
+  @param sem The semaphore.
+  @param timeout The time in milliseconds to wait, or 0 to wait for ever.
+  @returns 0 on success, or -1 if @c sem is NULL or the timeout expired.
+ */
+int SemaphoreDown(Semaphore* sem, timeout_t timeout);
+
+/** @brief Increment a semaphore, waking up a waiter if there is one.
+
+  @param sem The semaphore.
+  @returns 0 on success, or -1 if @c sem is NULL.
+ */
+int SemaphoreUp(Semaphore* sem);
+
+
+/** @brief A reusable barrier.
+
+  The barrier lives in user memory. Like a semaphore, a waiting thread 
+  spins for a short while before it sleeps, so that a phase where all
+  threads arrive at nearly the same time does not cost a sleep and a 
+  wakeup per thread.
+
+  @see BARRIER_INITIALIZER
+  @see BarrierWait
+ */
+typedef struct Barrier {
+	volatile int arrived;	/**< @brief Threads arrived in the current phase */
+	volatile int epoch;		/**< @brief The number of completed phases */
+} Barrier;
+
+/** @brief Initializer for a barrier. */
+#define BARRIER_INITIALIZER ((Barrier){ 0, 0 })
+
+/** @brief Wait at a barrier, until @c n threads have arrived.
+
+  The barrier can be reused right away, for the next phase. All threads 
+  using the barrier must pass the same @c n.
+
+  @param bar The barrier.
+  @param n The number of threads synchronizing at the barrier.
+  @returns 1 to the last thread to arrive, 0 to the other threads, or -1 if 
+     @c bar is NULL or @c n is 0.
+ */
+int BarrierWait(Barrier* bar, unsigned int n);
+
+
 /*******************************************
  *
  * Process creation
@@ -241,6 +361,30 @@ typedef int (*Task)(int, void*);
 Pid_t Exec(Task task, int argl, void* args);
 
 
+/** @brief Create a new process, whose main thread has a given stack size.
+
+  This call is like @c Exec, except that the main thread of the new
+  process runs on a stack of @c stack_size bytes (rounded up to a page).
+  If @c stack_size is 0, the default stack size is used.
+
+  Stack memory is only committed when it is touched, so large stacks
+  are cheap. A thread that overflows its stack faults on a guard page,
+  instead of silently corrupting memory.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param stack_size the stack size of the main thread, or 0 for the default
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  @c stack_size is not 0 and less than @c THREAD_STACK_MIN.
+  @see Exec
+  */
+Pid_t ExecStack(Task task, int argl, void* args, unsigned int stack_size);
+
+
 /** @brief Exit the current process.
 
   When this function is called by a process thread, the process terminates
@@ -319,6 +463,22 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This call is like @c CreateThread, except that the new thread runs on a
+  stack of @c stack_size bytes (rounded up to a page). If @c stack_size is 0,
+  the default stack size is used. Small stacks allow a process to have many
+  threads; large stacks are only committed to memory as they are used.
+
+  @param task a function to execute
+  @param stack_size the stack size of the new thread, or 0 for the default
+  @return the Tid of the new thread, or NOTHREAD if @c stack_size is not 0
+    and less than @c THREAD_STACK_MIN.
+  @see CreateThread
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -489,6 +649,42 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief The return value of an operation that would block on a non-blocking stream. 
+
+  This is returned by @c Read, @c Write and @c Accept, on a stream
+  that has the @c FD_NONBLOCK flag.
+  @see Fcntl
+ */
+#define WOULDBLOCK (-2)
+
+/** @brief Stream flag: operations return @c WOULDBLOCK instead of blocking. */
+#define FD_NONBLOCK 1
+
+/** @brief Commands for @c Fcntl. */
+typedef enum {
+  FCNTL_GETFL=1,    /**< Return the flags of the stream. */
+  FCNTL_SETFL=2     /**< Set the flags of the stream. */
+} fcntl_cmd;
+
+/** @brief Get or set the flags of a stream.
+
+  The flags belong to the stream, so they are shared by all file ids
+  that refer to it (see @c Dup2). The only flag is @c FD_NONBLOCK. 
+  With it, a @c Read from a pipe, socket or terminal that has no data, 
+  a @c Write to a full pipe or socket, or an @c Accept on a listening 
+  socket without pending connections, returns @c WOULDBLOCK at once.
+
+  @param fd the file id of the stream
+  @param cmd @c FCNTL_GETFL or @c FCNTL_SETFL
+  @param flags the new flags, for @c FCNTL_SETFL
+  @returns the flags for @c FCNTL_GETFL, 0 for @c FCNTL_SETFL, or -1 on 
+    error. Possible reasons for error:
+    - The file id is invalid.
+    - The command or the flags are invalid.
+ */
+int Fcntl(Fid_t fd, fcntl_cmd cmd, int flags);
+
 /*******************************************
  *
  * Pipes
@@ -517,7 +713,7 @@ typedef struct pipe_s {
 	A pipe is a one-directional buffer accessed via two file ids,
 	one for each end of the buffer. The size of the buffer is 
 	implementation-specific, but can be assumed to be between 4 and 16 
-	kbytes. 
+	kbytes. It can be changed by @c PipeCapacity().
 
 	Once a pipe is constructed, it remains operational as long as both
 	ends are open. If the read end is closed, the write end becomes 
@@ -531,6 +727,60 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+
+/** @brief The largest buffer capacity of a pipe, in bytes. */
+#define PIPE_MAX_CAPACITY (1 << 20)
+
+/**
+	@brief Query or change the buffer capacity of a pipe or socket.
+
+	For a pipe, @c fid may be either end. For a connected socket, the call
+	concerns the buffer of incoming data, i.e., the direction read from 
+	@c fid; the peer controls the other direction.
+
+	A capacity is rounded up to a power of two, of at least 256 bytes. It 
+	can be at most @c PIPE_MAX_CAPACITY and no less than the number of bytes 
+	currently buffered. A larger buffer lets a fast writer run ahead, 
+	blocking less often; a smaller one saves memory on idle streams.
+
+	@param fid a file id of a pipe or a connected socket.
+	@param capacity the new capacity in bytes, or 0 to leave it unchanged.
+	@returns the (new) capacity, or -1 on error. Possible reasons for error:
+		- @c fid is not a pipe end or a connected socket.
+		- @c capacity is negative or larger than @c PIPE_MAX_CAPACITY.
+		- more bytes than @c capacity are buffered.
+*/
+int PipeCapacity(Fid_t fid, int capacity);
+
+
+/**
+	@brief Move data from one stream to another, inside the kernel.
+
+	This is like a @c Read from @c fd_in followed by a @c Write of the same
+	data to @c fd_out, without a user buffer. When the input is the read 
+	end of a pipe or a connected socket and the output is the write end of 
+	a pipe or a connected socket, the data moves directly between their 
+	buffers, with a single copy. When all of the input buffer goes into an
+	empty output buffer of the same capacity, the buffers are exchanged and
+	nothing is copied.
+
+	The call blocks until some data can be moved, like @c Read and 
+	@c Write. If a stream has the @c FD_NONBLOCK flag and the call would 
+	wait for it, @c WOULDBLOCK is returned. For other streams, the data
+	is moved through a kernel buffer, and all the data read is written,
+	regardless of the flags of @c fd_out.
+
+	@param fd_in the file id to read from
+	@param fd_out the file id to write to
+	@param len the maximum number of bytes to move
+	@returns the number of bytes moved, 0 at the end of data of @c fd_in, 
+		or -1 on error. Possible reasons for error:
+		- either file id is invalid, or cannot be read or written respectively.
+		- the output is a pipe or socket whose reading end is closed.
+		- the input and output are the same pipe.
+*/
+int Splice(Fid_t fd_in, Fid_t fd_out, unsigned int len);
+
 /*******************************************
  *
  * Sockets (local)
@@ -695,6 +945,106 @@ int ShutDown(Fid_t sock, shutdown_mode how);
 
 
 
+/*******************************************
+ *
+ * Readiness polling
+ *
+ *******************************************/
+
+/** @brief Poll event: a @c Read (or @c Accept) would not block. */
+#define EPOLLIN 1
+/** @brief Poll event: a @c Write would not block. */
+#define EPOLLOUT 2
+/** @brief Poll event: the peer has closed the stream. Always reported. */
+#define EPOLLHUP 4
+/** @brief Poll event: writing to the stream fails. Always reported. */
+#define EPOLLERR 8
+/** @brief Watch flag: report events edge-triggered. */
+#define EPOLLET (1<<8)
+
+/** @brief A flag for @c EpollWait, to return without waiting. */
+#define EPOLL_NOWAIT ((timeout_t)-1)
+
+/** @brief The operations of @c EpollCtl. */
+typedef enum {
+  EPOLL_CTL_ADD=1,    /**< Start watching a stream. */
+  EPOLL_CTL_MOD=2,    /**< Change the events watched for a stream. */
+  EPOLL_CTL_DEL=3     /**< Stop watching a stream. */
+} epoll_op;
+
+/** @brief An event reported by @c EpollWait. */
+typedef struct epoll_event {
+  Fid_t fd;       /**< @brief The file id of the ready stream */
+  int events;     /**< @brief The ready events */
+} epoll_event;
+
+
+/** @brief Create a new polling instance.
+
+  A polling instance watches a set of streams, and reports the ones 
+  which are ready for I/O. Pipes, sockets that listen or are connected,
+  terminals and the null device can be watched.
+
+  Streams signal the instance when they become ready, so the cost of 
+  @c EpollWait depends on the number of ready streams, not on the number
+  of watched streams.
+
+  The instance is closed by @c Close.
+
+  @returns a file id for the instance, or @c NOFILE on error. Possible
+    reasons for error:
+    - The maximum number of file ids for the process has been reached.
+  @see EpollCtl
+  @see EpollWait
+ */
+Fid_t EpollCreate();
+
+
+/** @brief Add, change or remove a stream watched by a polling instance.
+
+  The events are a mask of @c EPOLLIN and @c EPOLLOUT, possibly with 
+  @c EPOLLET. @c EPOLLHUP and @c EPOLLERR are always watched.
+
+  In the default, level-triggered mode, a stream is reported by every
+  call to @c EpollWait while it is ready. In edge-triggered mode, a stream
+  is reported once each time it signals a change; the caller should then 
+  do I/O until it gets @c WOULDBLOCK (see @c Fcntl).
+
+  Streams are watched by file id. The instance does not keep a watched 
+  stream open, and a watch ends when the stream is closed, or when its 
+  file id is closed, even without @c EPOLL_CTL_DEL. A reused file id can 
+  then be added again.
+
+  @param epfd the polling instance
+  @param op the operation
+  @param fd the file id of the stream
+  @param events the events to watch, for @c EPOLL_CTL_ADD and @c EPOLL_CTL_MOD
+  @returns 0 on success, or -1 on error. Possible reasons for error:
+    - @c epfd is not a polling instance.
+    - @c fd is not open, or is not a stream that can be watched.
+    - @c fd is already watched, for @c EPOLL_CTL_ADD, or it is not, 
+      for the other operations.
+    - @c op or @c events are invalid.
+ */
+int EpollCtl(Fid_t epfd, epoll_op op, Fid_t fd, int events);
+
+
+/** @brief Wait until some watched streams are ready.
+
+  @param epfd the polling instance
+  @param events an array to store the ready streams into
+  @param maxevents the size of @c events
+  @param timeout The time in milliseconds to wait, 0 to wait for ever, or
+    @c EPOLL_NOWAIT to return at once.
+  @returns the number of events stored, which is 0 if the timeout expired,
+    or -1 on error. Possible reasons for error:
+    - @c epfd is not a polling instance.
+    - @c events is NULL or @c maxevents is not positive.
+ */
+int EpollWait(Fid_t epfd, epoll_event* events, int maxevents, timeout_t timeout);
+
+
+
 /*******************************************
  *
  * System information
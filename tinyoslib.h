@@ -74,13 +74,10 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
 
-typedef struct barrier {
-	Mutex mx;
-	CondVar cv;
-	unsigned int count, epoch;
-} barrier;
+/** @brief A barrier, synchronized by the @c BarrierWait system call. */
+typedef Barrier barrier;
 
-#define BARRIER_INIT  ((barrier){ MUTEX_INIT, COND_INIT, 0, 0})
+#define BARRIER_INIT  BARRIER_INITIALIZER
 
 
 void BarrierSync(barrier* bar, unsigned int n);
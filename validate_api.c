@@ -509,6 +509,54 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 }
 
 
+struct broadcast_args {
+	Mutex* m;
+	CondVar* cv;
+	int* waiting;
+	int* go;
+	int* done;
+};
+
+static int broadcast_waiter(int argl, void* args)
+{
+	struct broadcast_args* A = args;
+	Mutex_Lock(A->m);
+	(* A->waiting) ++;
+	while(! *A->go)
+		Cond_Wait(A->m, A->cv);
+	(* A->done) ++;
+	Mutex_Unlock(A->m);
+	return 0;
+}
+
+BOOT_TEST(test_cond_broadcast_unlocked,
+	"Test that a broadcast by a thread not holding the mutex wakes all waiters,\n"
+	"and each of them returns holding the mutex."
+	)
+{
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int waiting = 0, go = 0, done = 0;
+	struct broadcast_args A = { &m, &cv, &waiting, &go, &done };
+
+	const int N = 50;
+	Tid_t t[N];
+	for(int i=0; i<N; i++) t[i] = CreateThread(broadcast_waiter, 0, &A);
+
+	CondVar nap = COND_INIT;
+	Mutex_Lock(&m);
+	while(waiting != N)
+		Cond_TimedWait(&m, &nap, 1);
+	go = 1;
+	Mutex_Unlock(&m);
+	Cond_Broadcast(&cv);
+
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(done == N);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -920,6 +968,7 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_unlocked,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -1398,6 +1447,82 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+/* Touch argl bytes of the stack */
+static int use_stack(int argl, void* args)
+{
+	volatile char buf[argl];
+	for(int i=0; i<argl; i+=512) buf[i] = (char) i;
+	int sum = 0;
+	for(int i=0; i<argl; i+=512) sum += buf[i];
+	(void) sum;
+	return argl;
+}
+
+BOOT_TEST(test_create_thread_stack,
+	"Test that threads can be created with small and large stacks, and that they can use them")
+{
+	int exitval;
+	Tid_t t = CreateThreadStack(use_stack, 4096, NULL, THREAD_STACK_MIN);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==4096);
+
+	/* Sizes are rounded up to a page */
+	t = CreateThreadStack(use_stack, 4096, NULL, THREAD_STACK_MIN+1);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+
+	/* A large stack is only committed as it is touched */
+	t = CreateThreadStack(use_stack, 4<<20, NULL, 64<<20);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==(4<<20));
+
+	/* 0 means the default size */
+	t = CreateThreadStack(use_stack, 64<<10, NULL, 0);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_create_thread_stack_error_on_small_stack,
+	"Test that CreateThreadStack and ExecStack fail on a stack size below THREAD_STACK_MIN")
+{
+	ASSERT(CreateThreadStack(use_stack, 0, NULL, 1)==NOTHREAD);
+	ASSERT(CreateThreadStack(use_stack, 0, NULL, THREAD_STACK_MIN-1)==NOTHREAD);
+	ASSERT(ExecStack(use_stack, 0, NULL, THREAD_STACK_MIN-1)==NOPROC);
+	return 0;
+}
+
+
+BOOT_TEST(test_exec_stack,
+	"Test that the main thread of a process can be given a stack size")
+{
+	int status;
+	Pid_t pid = ExecStack(use_stack, 4096, NULL, THREAD_STACK_MIN);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status==4096);
+	return 0;
+}
+
+
+BOOT_TEST(test_many_small_stack_threads,
+	"Test that many threads with small stacks can coexist")
+{
+	const int N = 1000;
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) {
+		tids[i] = CreateThreadStack(use_stack, 1024, NULL, THREAD_STACK_MIN);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
@@ -1416,6 +1541,10 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_create_thread_stack,
+	&test_create_thread_stack_error_on_small_stack,
+	&test_exec_stack,
+	&test_many_small_stack_threads,
 	NULL
 };
 
@@ -1514,6 +1643,107 @@ BOOT_TEST(test_pipe_close_writer,
 }
 
 
+static int blocked_reader(int argl, void* args)
+{
+	char c;
+	return Read(argl, &c, 1);
+}
+
+BOOT_TEST(test_pipe_close_writer_wakes_reader,
+	"Test that a reader blocked on an empty pipe gets end-of-file when the writer is closed"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	Tid_t t = CreateThread(blocked_reader, pipe.read, NULL);
+	ASSERT(t!=NOTHREAD);
+	Close(pipe.write);
+
+	int rc;
+	ASSERT(ThreadJoin(t, &rc)==0);
+	ASSERT(rc==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_many_blocked_readers,
+	"Test that many readers blocked on the same pipe are all served by one large write"
+	)
+{
+	const int N = 20;
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	Tid_t t[N];
+	for(int i=0; i<N; i++) {
+		t[i] = CreateThread(blocked_reader, pipe.read, NULL);
+		ASSERT(t[i]!=NOTHREAD);
+	}
+
+	char buf[N];
+	memset(buf, 'x', N);
+	ASSERT(Write(pipe.write, buf, N)==N);
+
+	for(int i=0; i<N; i++) {
+		int rc;
+		ASSERT(ThreadJoin(t[i], &rc)==0);
+		ASSERT(rc==1);
+	}
+	return 0;
+}
+
+
+static int null_child(int argl, void* args) { return argl; }
+
+/* Each thread sends data to itself over its own pipe, and runs child processes */
+static int syscall_worker(int argl, void* args)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	char out[100], in[100];
+	for(int i=0; i<200; i++) {
+		for(int j=0; j<100; j++) out[j] = (char)(argl+i+j);
+		ASSERT(Write(pipe.write, out, 100)==100);
+		ASSERT(Read(pipe.read, in, 100)==100);
+		ASSERT(memcmp(in, out, 100)==0);
+
+		ASSERT(GetPPid()==1);
+		if(i % 20 == 0) {
+			int status;
+			Pid_t pid = Exec(null_child, i, NULL);
+			ASSERT(pid!=NOPROC);
+			ASSERT(WaitChild(pid, &status)==pid);
+			ASSERT(status==i);
+		}
+	}
+
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Close(pipe.write)==0);
+	return 0;
+}
+
+static int concurrent_syscalls_main(int argl, void* args)
+{
+	const int N = 6;
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		ASSERT((tids[i] = CreateThread(syscall_worker, i, NULL))!=NOTHREAD);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+BOOT_TEST(test_concurrent_syscalls,
+	"Test that threads of a process can use pipes and create processes concurrently"
+	)
+{
+	ASSERT(run_get_status(concurrent_syscalls_main, 0, NULL)==0);
+	return 0;
+}
+
+
 /* Takes one integer argument, writes that many bytes to stdout.
  */
 int data_producer(int argl, void* args)
@@ -1633,6 +1863,161 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+BOOT_TEST(test_pipe_capacity,
+	"Test that the capacity of a pipe can be queried and changed, keeping its contents."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	int cap = PipeCapacity(pipe.read, 0);
+	ASSERT(cap >= 256);
+	ASSERT(PipeCapacity(pipe.write, 0)==cap);
+
+	/* Bad arguments */
+	ASSERT(PipeCapacity(NOFILE, 0)==-1);
+	ASSERT(PipeCapacity(OpenNull(), 0)==-1);
+	ASSERT(PipeCapacity(pipe.read, -1)==-1);
+	ASSERT(PipeCapacity(pipe.read, PIPE_MAX_CAPACITY+1)==-1);
+
+	/* Rounded up to a power of two */
+	ASSERT(PipeCapacity(pipe.read, 1000)==1024);
+
+	/* Make the contents wrap around the end of the buffer */
+	char buf[1024];
+	unsigned char next_in = 0, next_out = 0;
+	for(int i=0; i<700; i++) buf[i] = next_in++;
+	ASSERT(Write(pipe.write, buf, 700)==700);
+	ASSERT(Read(pipe.read, buf, 500)==500);
+	for(int i=0; i<500; i++) ASSERT((unsigned char)buf[i] == next_out++);
+	for(int i=0; i<600; i++) buf[i] = next_in++;
+	ASSERT(Write(pipe.write, buf, 600)==600);
+
+	/* 800 bytes are in the pipe */
+	ASSERT(PipeCapacity(pipe.read, 512)==-1);
+	ASSERT(PipeCapacity(pipe.write, PIPE_MAX_CAPACITY)==PIPE_MAX_CAPACITY);
+	ASSERT(Read(pipe.read, buf, 1024)==800);
+	for(int i=0; i<800; i++) ASSERT((unsigned char)buf[i] == next_out++);
+
+	/* A large pipe does not block a single writer */
+	static char big[PIPE_MAX_CAPACITY];
+	ASSERT(Write(pipe.write, big, PIPE_MAX_CAPACITY)==PIPE_MAX_CAPACITY);
+	ASSERT(Read(pipe.read, big, PIPE_MAX_CAPACITY)==PIPE_MAX_CAPACITY);
+
+	ASSERT(PipeCapacity(pipe.read, 1)==256);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(PipeCapacity(pipe.write, 0)==256);
+	ASSERT(Close(pipe.write)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_nonblocking,
+	"Test that a non-blocking pipe returns WOULDBLOCK instead of sleeping."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	ASSERT(Fcntl(pipe.read, FCNTL_GETFL, 0)==0);
+	ASSERT(Fcntl(pipe.read, FCNTL_SETFL, FD_NONBLOCK)==0);
+	ASSERT(Fcntl(pipe.read, FCNTL_GETFL, 0)==FD_NONBLOCK);
+	ASSERT(Fcntl(pipe.write, FCNTL_SETFL, FD_NONBLOCK)==0);
+
+	/* Bad arguments */
+	ASSERT(Fcntl(NOFILE, FCNTL_GETFL, 0)==-1);
+	ASSERT(Fcntl(pipe.read, FCNTL_SETFL, 2)==-1);
+	ASSERT(Fcntl(pipe.read, 0, 0)==-1);
+
+	char buf[256];
+	ASSERT(Read(pipe.read, buf, 256)==WOULDBLOCK);
+
+	/* Fill the pipe */
+	ASSERT(PipeCapacity(pipe.write, 256)==256);
+	ASSERT(Write(pipe.write, buf, 200)==200);
+	ASSERT(Write(pipe.write, buf, 200)==56);
+	ASSERT(Write(pipe.write, buf, 200)==WOULDBLOCK);
+
+	ASSERT(Read(pipe.read, buf, 256)==256);
+	ASSERT(Read(pipe.read, buf, 256)==WOULDBLOCK);
+
+	/* The flag is shared by duplicated descriptors */
+	Fid_t fd = OpenNull();
+	ASSERT(Dup2(pipe.read, fd)==0);
+	ASSERT(Fcntl(fd, FCNTL_GETFL, 0)==FD_NONBLOCK);
+	ASSERT(Fcntl(fd, FCNTL_SETFL, 0)==0);
+	ASSERT(Fcntl(pipe.read, FCNTL_GETFL, 0)==0);
+	ASSERT(Close(fd)==0);
+
+	/* End of data is still reported as 0 */
+	ASSERT(Fcntl(pipe.read, FCNTL_SETFL, FD_NONBLOCK)==0);
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Read(pipe.read, buf, 256)==0);
+	ASSERT(Close(pipe.read)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_splice_pipes,
+	"Test that Splice moves data between pipes, in order, and between other streams."
+	)
+{
+	pipe_t a, b;
+	ASSERT(Pipe(&a)==0);
+	ASSERT(Pipe(&b)==0);
+	char buf[4096];
+
+	/* All of a into an empty b */
+	ASSERT(Write(a.write, "hello", 5)==5);
+	ASSERT(Splice(a.read, b.write, 100)==5);
+	ASSERT(Read(b.read, buf, sizeof(buf))==5);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+
+	/* Bytes that wrap around both rings */
+	unsigned char next_in = 0, next_out = 0;
+	ASSERT(PipeCapacity(b.write, 512)==512);
+	ASSERT(Write(a.write, buf, 3000)==3000);
+	ASSERT(Read(a.read, buf, 3000)==3000);
+	for(int i=0; i<2000; i++) buf[i] = next_in++;
+	ASSERT(Write(a.write, buf, 2000)==2000);
+	for(int moved = 0; moved < 2000; ) {
+		int n = Splice(a.read, b.write, 2000);
+		ASSERT(n > 0 && n <= 512);
+		moved += n;
+		ASSERT(Read(b.read, buf, sizeof(buf))==n);
+		for(int i=0; i<n; i++) ASSERT((unsigned char)buf[i] == next_out++);
+	}
+
+	/* Errors */
+	ASSERT(Splice(NOFILE, b.write, 10)==-1);
+	ASSERT(Splice(a.read, NOFILE, 10)==-1);
+	ASSERT(Splice(a.read, a.write, 10)==-1);
+	ASSERT(Splice(a.write, b.write, 10)==-1);
+	ASSERT(Splice(a.read, b.read, 10)==-1);
+	ASSERT(Splice(a.read, b.write, 0)==0);
+
+	/* Non-blocking input */
+	ASSERT(Fcntl(a.read, FCNTL_SETFL, FD_NONBLOCK)==0);
+	ASSERT(Splice(a.read, b.write, 10)==WOULDBLOCK);
+
+	/* Other streams go through a kernel buffer */
+	Fid_t null = OpenNull();
+	ASSERT(Splice(null, a.write, 100)==100);
+	ASSERT(Splice(a.read, null, 1000)==100);
+
+	/* End of data */
+	ASSERT(Close(a.write)==0);
+	ASSERT(Splice(a.read, b.write, 10)==0);
+
+	/* Closed output */
+	ASSERT(Pipe(&a)==0);
+	ASSERT(Write(a.write, "hello", 5)==5);
+	ASSERT(Close(b.read)==0);
+	ASSERT(Splice(a.read, b.write, 10)==-1);
+	return 0;
+}
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1643,6 +2028,12 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipe_close_writer_wakes_reader,
+	&test_pipe_many_blocked_readers,
+	&test_concurrent_syscalls,
+	&test_pipe_capacity,
+	&test_pipe_nonblocking,
+	&test_splice_pipes,
 	NULL
 };
 
@@ -2189,6 +2580,162 @@ BOOT_TEST(test_shudown_write,
 }
 
 
+static int shutdown_blocked_reader(int sock, void* args)
+{
+	char buffer[12];
+	ASSERT(Read(sock, buffer, 12)==-1);
+	return 0;
+}
+
+BOOT_TEST(test_shutdown_wakes_blocked_reader,
+	"Test that ShutDown with SHUTDOWN_READ fails a Read blocked on the same socket, "
+	"while the peer keeps the connection open"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	for(uint i=0; i<100; i++) {
+		Tid_t t = CreateThread(shutdown_blocked_reader, srv, NULL);
+		if(i==0) ShutDown(srv, SHUTDOWN_READ);
+		ASSERT(ThreadJoin(t, NULL)==0);
+	}
+	check_transfer(srv, cli);
+	return 0;
+}
+
+
+
+
+BOOT_TEST(test_socket_capacity,
+	"Test that each direction of a connection has its own capacity."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(PipeCapacity(lsock, 0)==-1);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(PipeCapacity(lsock, 0)==-1);
+
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	int cap = PipeCapacity(cli, 0);
+	ASSERT(cap >= 256);
+	ASSERT(PipeCapacity(srv, 65536)==65536);
+	ASSERT(PipeCapacity(srv, 0)==65536);
+	ASSERT(PipeCapacity(cli, 0)==cap);
+
+	/* The client can now send 64 kbytes without a reader */
+	static char buf[65536];
+	ASSERT(Write(cli, buf, 65536)==65536);
+	ASSERT(Read(srv, buf, 65536)==65536);
+
+	ASSERT(ShutDown(srv, SHUTDOWN_READ)==0);
+	ASSERT(PipeCapacity(srv, 0)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_accept_nonblocking,
+	"Test that Accept on a non-blocking listener returns WOULDBLOCK when no request is pending."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(Fcntl(lsock, FCNTL_SETFL, FD_NONBLOCK)==0);
+	ASSERT(Accept(lsock)==WOULDBLOCK);
+
+	/* connect_sockets() needs a blocking Accept */
+	ASSERT(Fcntl(lsock, FCNTL_SETFL, 0)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	ASSERT(Fcntl(lsock, FCNTL_SETFL, FD_NONBLOCK)==0);
+	ASSERT(Accept(lsock)==WOULDBLOCK);
+
+	/* Reading a connected socket with no data */
+	ASSERT(Fcntl(srv, FCNTL_SETFL, FD_NONBLOCK)==0);
+	char buf[16];
+	ASSERT(Read(srv, buf, 16)==WOULDBLOCK);
+	ASSERT(Write(cli, "hello", 5)==5);
+	ASSERT(Read(srv, buf, 16)==5);
+	return 0;
+}
+
+
+BOOT_TEST(test_splice_sockets,
+	"Test that Splice moves data from a pipe to a socket and from a socket to a pipe."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	char buf[16];
+
+	ASSERT(Write(p.write, "hello", 5)==5);
+	ASSERT(Splice(p.read, cli, 16)==5);
+	ASSERT(Splice(srv, p.write, 16)==5);
+	ASSERT(Read(p.read, buf, 16)==5);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+
+	/* An echo, from one direction of a connection to the other */
+	ASSERT(Write(srv, "world", 5)==5);
+	ASSERT(Splice(cli, cli, 16)==5);
+	ASSERT(Read(srv, buf, 16)==5);
+	ASSERT(memcmp(buf, "world", 5)==0);
+
+	/* Both ends of a connection read and write the same pipes */
+	ASSERT(Splice(cli, srv, 16)==-1);
+
+	ASSERT(Splice(lsock, p.write, 16)==-1);
+	ASSERT(ShutDown(cli, SHUTDOWN_WRITE)==0);
+	ASSERT(Splice(srv, p.write, 16)==0);
+	return 0;
+}
+
+
+static int splice_blocked_thread(int sock, void* args)
+{
+	pipe_t* p = args;
+	ASSERT(Splice(sock, p->write, 16)==-1);
+	return 0;
+}
+
+BOOT_TEST(test_splice_shutdown,
+	"Test that Splice fails on a socket end that is shut down, also when it is "
+	"blocked on it."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	Tid_t t = CreateThread(splice_blocked_thread, srv, &p);
+	ASSERT(ShutDown(srv, SHUTDOWN_READ)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Nothing is written to a shut down socket */
+	ASSERT(Write(p.write, "hello", 5)==5);
+	ASSERT(ShutDown(cli, SHUTDOWN_WRITE)==0);
+	ASSERT(Splice(p.read, cli, 16)==-1);
+	char buf[16];
+	ASSERT(Read(p.read, buf, 16)==5);
+	return 0;
+}
 
 
 TEST_SUITE(socket_tests,
@@ -2212,6 +2759,7 @@ TEST_SUITE(socket_tests,
 	&test_accept_reusable,
 	&test_accept_fails_on_exhausted_fid,
 	&test_accept_unblocks_on_close,
+	&test_accept_nonblocking,
 
 	&test_connect_fails_on_bad_fid,
 	&test_connect_fails_on_bad_socket,
@@ -2225,7 +2773,497 @@ TEST_SUITE(socket_tests,
 
 	&test_shudown_read,
 	&test_shudown_write,
+	&test_shutdown_wakes_blocked_reader,
+
+	&test_socket_capacity,
+	&test_splice_sockets,
+	&test_splice_shutdown,
+
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Futex tests
+ *
+ *
+ *
+ *********************************************/
+
+
+BOOT_TEST(test_wait_on_address_mismatch,
+	"Test that WaitOnAddress returns immediately when the value is not the expected one."
+	)
+{
+	volatile int x = 5;
+	ASSERT(WaitOnAddress(&x, 4, 0)==-1);
+	ASSERT(WaitOnAddress(NULL, 0, 0)==-1);
+	ASSERT(WakeAddress(&x, -1)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_wait_on_address_timeout,
+	"Test that WaitOnAddress returns -1 when its timeout expires."
+	)
+{
+	volatile int x = 0;
+	ASSERT(WaitOnAddress(&x, 0, 20)==-1);
+	return 0;
+}
+
+
+static volatile int futex_word;
 
+static int futex_waiter(int argl, void* args)
+{
+	while(futex_word == 0)
+		WaitOnAddress(&futex_word, 0, 0);
+	return 0;
+}
+
+BOOT_TEST(test_wake_address,
+	"Test that WakeAddress wakes up at most the requested number of waiters."
+	)
+{
+	const int N = 10;
+	futex_word = 0;
+
+	Tid_t t[N];
+	for(int i=0; i<N; i++) t[i] = CreateThread(futex_waiter, 0, NULL);
+
+	/* Give the waiters time to block */
+	volatile int nap = 0;
+	WaitOnAddress(&nap, 0, 50);
+
+	/* The waiters re-check the word, and block again */
+	ASSERT(WakeAddress(&futex_word, 3)==3);
+	WaitOnAddress(&nap, 0, 50);
+
+	futex_word = 1;
+	ASSERT(WakeAddress(&futex_word, -1)==N);
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+
+/* A user-level lock that only enters the kernel on contention: 
+   0 = free, 1 = locked, 2 = locked with waiters */
+static void futex_lock(volatile int* lk)
+{
+	int c = __sync_val_compare_and_swap(lk, 0, 1);
+	if(c == 0) return;
+	if(c != 2) c = __atomic_exchange_n(lk, 2, __ATOMIC_ACQUIRE);
+	while(c != 0) {
+		WaitOnAddress(lk, 2, 0);
+		c = __atomic_exchange_n(lk, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void futex_unlock(volatile int* lk)
+{
+	if(__atomic_exchange_n(lk, 0, __ATOMIC_RELEASE) == 2)
+		WakeAddress(lk, 1);
+}
+
+static volatile int futex_lk;
+static int futex_counter;
+
+static int futex_incr(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		futex_lock(&futex_lk);
+		futex_counter++;
+		futex_unlock(&futex_lk);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_futex_lock,
+	"Test a user-level lock built on WaitOnAddress and WakeAddress."
+	)
+{
+	const int T = 8, N = 5000;
+	futex_lk = 0;
+	futex_counter = 0;
+
+	Tid_t t[T];
+	for(int i=0; i<T; i++) t[i] = CreateThread(futex_incr, N, NULL);
+	for(int i=0; i<T; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	ASSERT(futex_counter == T*N);
+	ASSERT(futex_lk == 0);
+	return 0;
+}
+
+
+static Semaphore sem;
+static volatile int sem_inside, sem_max_inside;
+
+static int sem_worker(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		ASSERT(SemaphoreDown(&sem, 0)==0);
+		int in = __atomic_add_fetch(&sem_inside, 1, __ATOMIC_SEQ_CST);
+		if(in > sem_max_inside) sem_max_inside = in;
+		if(i % 8 == 0) sleep_thread(0);
+		__atomic_sub_fetch(&sem_inside, 1, __ATOMIC_SEQ_CST);
+		ASSERT(SemaphoreUp(&sem)==0);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_semaphore,
+	"Test that a semaphore of value K admits at most K threads at a time, and "
+	"that SemaphoreDown times out."
+	)
+{
+	const int K = 3, T = 10, N = 300;
+	sem = SEMAPHORE_INIT(K);
+	sem_inside = sem_max_inside = 0;
+
+	Tid_t t[T];
+	for(int i=0; i<T; i++) t[i] = CreateThread(sem_worker, N, NULL);
+	for(int i=0; i<T; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	ASSERT(sem_max_inside <= K);
+	ASSERT(sem.count == K);
+	ASSERT(sem.sleepers == 0);
+
+	Semaphore empty = SEMAPHORE_INIT(0);
+	ASSERT(SemaphoreDown(&empty, 20)==-1);
+	ASSERT(SemaphoreUp(&empty)==0);
+	ASSERT(SemaphoreDown(&empty, 20)==0);
+	ASSERT(SemaphoreDown(NULL, 0)==-1);
+	return 0;
+}
+
+
+static Barrier bar;
+static volatile int bar_phase[8];
+static volatile int bar_serial;
+
+static int bar_worker(int argl, void* args)
+{
+	const int T = 8, N = 200;
+	for(int i=0; i<N; i++) {
+		bar_phase[argl] = i;
+		if(BarrierWait(&bar, T)==1) 
+			__atomic_add_fetch(&bar_serial, 1, __ATOMIC_SEQ_CST);
+		/* Everybody has finished phase i */
+		for(int j=0; j<T; j++) ASSERT(bar_phase[j] >= i);
+		BarrierWait(&bar, T);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_barrier,
+	"Test that no thread passes a barrier before all have arrived, in many phases."
+	)
+{
+	const int T = 8;
+	bar = BARRIER_INITIALIZER;
+	bar_serial = 0;
+	for(int j=0; j<T; j++) bar_phase[j] = -1;
+
+	Tid_t t[T];
+	for(int i=0; i<T; i++) t[i] = CreateThread(bar_worker, i, NULL);
+	for(int i=0; i<T; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	ASSERT(bar_serial == 200);
+	ASSERT(bar.arrived == 0);
+	ASSERT(BarrierWait(&bar, 0)==-1);
+	ASSERT(BarrierWait(&bar, 1)==1);
+	return 0;
+}
+
+
+TEST_SUITE(futex_tests,
+	"A suite of tests for WaitOnAddress and WakeAddress, and for semaphores "
+	"and barriers."
+	)
+{
+	&test_wait_on_address_mismatch,
+	&test_wait_on_address_timeout,
+	&test_wake_address,
+	&test_futex_lock,
+	&test_semaphore,
+	&test_barrier,
+	NULL
+};
+
+
+
+BOOT_TEST(test_epoll_errors,
+	"Test that the polling system calls check their arguments."
+	)
+{
+	Fid_t ep = EpollCreate();
+	ASSERT(ep != NOFILE);
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	epoll_event ev[4];
+
+	ASSERT(EpollCtl(NOFILE, EPOLL_CTL_ADD, pipe.read, EPOLLIN)==-1);
+	ASSERT(EpollCtl(pipe.read, EPOLL_CTL_ADD, pipe.write, EPOLLIN)==-1);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, NOFILE, EPOLLIN)==-1);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, MAX_FILEID, EPOLLIN)==-1);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, pipe.read, 1<<12)==-1);
+	ASSERT(EpollCtl(ep, 0, pipe.read, EPOLLIN)==-1);
+
+	/* Instances and unconnected sockets cannot be watched */
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, ep, EPOLLIN)==-1);
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, sock, EPOLLIN)==-1);
+
+	ASSERT(EpollCtl(ep, EPOLL_CTL_MOD, pipe.read, EPOLLIN)==-1);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_DEL, pipe.read, 0)==-1);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, pipe.read, EPOLLIN)==0);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, pipe.read, EPOLLIN)==-1);
+
+	ASSERT(EpollWait(ep, NULL, 4, EPOLL_NOWAIT)==-1);
+	ASSERT(EpollWait(ep, ev, 0, EPOLL_NOWAIT)==-1);
+	ASSERT(EpollWait(pipe.write, ev, 4, EPOLL_NOWAIT)==-1);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==0);
+
+	ASSERT(Close(ep)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_epoll_pipe_level,
+	"Test that a level-triggered watch reports a pipe for as long as it is ready."
+	)
+{
+	Fid_t ep = EpollCreate();
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	epoll_event ev[4];
+	char buf[16];
+
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, pipe.read, EPOLLIN)==0);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==0);
+
+	ASSERT(Write(pipe.write, "hello", 5)==5);
+	for(int i=0; i<3; i++) {
+		ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==1);
+		ASSERT(ev[0].fd == pipe.read);
+		ASSERT(ev[0].events == EPOLLIN);
+	}
+	ASSERT(Read(pipe.read, buf, 16)==5);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==0);
+
+	/* The write end is ready while there is space */
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, pipe.write, EPOLLOUT)==0);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==1);
+	ASSERT(ev[0].fd == pipe.write && ev[0].events == EPOLLOUT);
+
+	/* The read end is never writable */
+	ASSERT(EpollCtl(ep, EPOLL_CTL_MOD, pipe.read, EPOLLOUT)==0);
+	ASSERT(Write(pipe.write, "hello", 5)==5);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==1);
+	ASSERT(ev[0].fd == pipe.write);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_MOD, pipe.read, EPOLLIN)==0);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==2);
+	ASSERT(EpollWait(ep, ev, 1, EPOLL_NOWAIT)==1);
+
+	/* Closing the write end is seen at the read end */
+	ASSERT(EpollCtl(ep, EPOLL_CTL_DEL, pipe.write, 0)==0);
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==1);
+	ASSERT(ev[0].fd == pipe.read && ev[0].events == (EPOLLIN|EPOLLHUP));
+
+	/* Closing the instance leaves the read end alone */
+	ASSERT(Close(ep)==0);
+	ASSERT(Read(pipe.read, buf, 16)==5);
+	ASSERT(Close(pipe.read)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_epoll_close_without_del,
+	"Test that closing a watched file id ends the watch, and that a reused "
+	"file id can be watched again."
+	)
+{
+	Fid_t ep = EpollCreate();
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	epoll_event ev[4];
+	char buf[16];
+
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, pipe.read, EPOLLIN)==0);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, pipe.write, EPOLLOUT)==0);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==1);
+	ASSERT(ev[0].fd == pipe.write);
+
+	/* The watch does not keep the write end open */
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Read(pipe.read, buf, 16)==0);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==1);
+	ASSERT(ev[0].fd == pipe.read && ev[0].events == (EPOLLIN|EPOLLHUP));
+	ASSERT(EpollCtl(ep, EPOLL_CTL_MOD, pipe.write, EPOLLOUT)==-1);
+
+	/* The file id is reused, and its events are those of the new stream */
+	pipe_t pipe2;
+	ASSERT(Pipe(&pipe2)==0);
+	Fid_t fd = (pipe2.read == pipe.write) ? pipe2.read : pipe2.write;
+	ASSERT(fd == pipe.write);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, fd, EPOLLIN|EPOLLOUT)==0);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==(fd == pipe2.write));
+	ASSERT(Write(pipe2.write, "hello", 5)==5);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==1);
+	ASSERT(ev[0].fd == fd);
+
+	/* A file id closed and reused behind our back is not reported */
+	ASSERT(Close(fd)==0);
+	Fid_t other = (fd == pipe2.read) ? pipe2.write : pipe2.read;
+	ASSERT(Dup2(other, fd)==0);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==0);
+
+	ASSERT(Close(ep)==0);
+	ASSERT(Close(pipe2.read)==0);
+	ASSERT(Close(pipe2.write)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_epoll_pipe_edge,
+	"Test that an edge-triggered watch reports a pipe once per change."
+	)
+{
+	Fid_t ep = EpollCreate();
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	epoll_event ev[4];
+	char buf[16];
+
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, pipe.read, EPOLLIN|EPOLLET)==0);
+	ASSERT(Write(pipe.write, "hello", 5)==5);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==1);
+	ASSERT(ev[0].fd == pipe.read && ev[0].events == EPOLLIN);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==0);
+
+	/* New data is a new edge */
+	ASSERT(Write(pipe.write, "hello", 5)==5);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==1);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==0);
+
+	/* An edge that is gone before the wait is not reported */
+	ASSERT(Write(pipe.write, "hello", 5)==5);
+	ASSERT(Read(pipe.read, buf, 16)==15);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==0);
+
+	ASSERT(Close(ep)==0);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Close(pipe.write)==0);
+	return 0;
+}
+
+
+static int epoll_writer_thread(int fd, void* args)
+{
+	Fid_t* fds = args;
+	for(int i=0; i<4; i++)
+		ASSERT(Write(fds[i], "x", 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_epoll_wait_blocks,
+	"Test that EpollWait sleeps until a watched stream is ready, or the timeout expires."
+	)
+{
+	Fid_t ep = EpollCreate();
+	pipe_t pipes[4];
+	Fid_t wfds[4];
+	for(int i=0; i<4; i++) {
+		ASSERT(Pipe(&pipes[i])==0);
+		wfds[i] = pipes[i].write;
+		ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, pipes[i].read, EPOLLIN|EPOLLET)==0);
+	}
+
+	epoll_event ev[4];
+	ASSERT(EpollWait(ep, ev, 4, 20)==0);
+
+	Tid_t t = CreateThread(epoll_writer_thread, 0, wfds);
+	int seen = 0;
+	while(seen < 4) {
+		int n = EpollWait(ep, ev, 4, 0);
+		ASSERT(n > 0);
+		for(int i=0; i<n; i++) {
+			char c;
+			ASSERT(ev[i].events == EPOLLIN);
+			ASSERT(Read(ev[i].fd, &c, 1)==1);
+			seen++;
+		}
+	}
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(EpollWait(ep, ev, 4, EPOLL_NOWAIT)==0);
+	return 0;
+}
+
+
+static int epoll_connect_thread(int port, void* args)
+{
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, port, 1000)==0);
+	ASSERT(Write(sock, "hello", 5)==5);
+	ASSERT(Close(sock)==0);
+	return 0;
+}
+
+BOOT_TEST(test_epoll_sockets,
+	"Test that listening and connected sockets can be watched."
+	)
+{
+	Fid_t ep = EpollCreate();
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, lsock, EPOLLIN)==0);
+	epoll_event ev[2];
+	ASSERT(EpollWait(ep, ev, 2, EPOLL_NOWAIT)==0);
+
+	Tid_t t = CreateThread(epoll_connect_thread, 100, NULL);
+	ASSERT(EpollWait(ep, ev, 2, 0)==1);
+	ASSERT(ev[0].fd == lsock && ev[0].events == EPOLLIN);
+
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv != NOFILE);
+	ASSERT(EpollWait(ep, ev, 2, EPOLL_NOWAIT)==0);
+
+	ASSERT(EpollCtl(ep, EPOLL_CTL_ADD, srv, EPOLLIN)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* The data and the hangup of the peer */
+	ASSERT(EpollWait(ep, ev, 2, 0)==1);
+	ASSERT(ev[0].fd == srv);
+	ASSERT((ev[0].events & (EPOLLIN|EPOLLHUP)) == (EPOLLIN|EPOLLHUP));
+
+	char buf[16];
+	ASSERT(Read(srv, buf, 16)==5);
+	ASSERT(Read(srv, buf, 16)==0);
+	ASSERT(Close(ep)==0);
+	return 0;
+}
+
+
+TEST_SUITE(epoll_tests,
+	"A suite of tests for readiness polling."
+	)
+{
+	&test_epoll_errors,
+	&test_epoll_pipe_level,
+	&test_epoll_close_without_del,
+	&test_epoll_pipe_edge,
+	&test_epoll_wait_blocks,
+	&test_epoll_sockets,
 	NULL
 };
 
@@ -2573,6 +3611,8 @@ TEST_SUITE(all_tests,
 	&thread_tests,
 	&pipe_tests,
 	&socket_tests,
+	&futex_tests,
+	&epoll_tests,
 	NULL
 };
 